@@ -0,0 +1,343 @@
+/**
+ * @file		affinity.hpp
+ * A header-only CPU topology reader and thread placement helper for Linux.
+ *
+ * On platforms without sched_getaffinity() and pthread_setaffinity_np(), every
+ * hardware thread is treated as a separate core, there are no NUMA nodes, and
+ * threads are never pinned.
+ *
+ * @author		Jennifer Yao
+ * @date		2015
+ * @copyright	All rights reserved.
+ */
+
+#ifndef AFFINITY_HPP
+#define AFFINITY_HPP
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#define HAVE_THREAD_AFFINITY 1
+#endif
+
+/**
+ * Thread placement policies.
+ */
+enum class affinity_policy {
+	/** Threads are not pinned; the OS scheduler places them. */
+	none,
+	/** Threads fill one core (all of its hardware threads) and one socket at
+	    a time. */
+	compact,
+	/** Threads are spread round-robin across sockets, then cores, and only
+	    share a core once every core has a thread. */
+	scatter,
+	/** At most one thread per physical core, filling one socket at a
+	    time. */
+	physical_cores
+};
+
+/**
+ * Parses the argument of an --affinity=<policy> option. Returns false if
+ * @p name is not the name of a policy.
+ */
+inline bool parse_affinity_policy(const char* name, affinity_policy& policy) {
+	if (std::strcmp(name, "none") == 0)
+		policy = affinity_policy::none;
+	else if (std::strcmp(name, "compact") == 0)
+		policy = affinity_policy::compact;
+	else if (std::strcmp(name, "scatter") == 0)
+		policy = affinity_policy::scatter;
+	else if (std::strcmp(name, "physical-cores") == 0)
+		policy = affinity_policy::physical_cores;
+	else
+		return false;
+	return true;
+}
+
+// The description of the --affinity option, for the usage messages of the
+// programs that accept it.
+#define AFFINITY_OPTION_USAGE \
+	"  --affinity=<policy>  Pin threads to CPUs. <policy> is one of none (the\n" \
+	"                       default), compact, scatter or physical-cores.\n"
+
+/**
+ * Returns true if the command-line argument @p arg is an --affinity=<policy>
+ * option, which parse_affinity_option() handles.
+ */
+inline bool is_affinity_option(const char* arg) {
+	return std::strncmp(arg, "--affinity=", 11) == 0;
+}
+
+/**
+ * Stores the policy named by the --affinity=<policy> option @p arg in
+ * @p policy. If it names no policy, writes an error message on behalf of the
+ * program @p program_name to standard error, and returns false.
+ */
+inline bool parse_affinity_option(const char* program_name, const char* arg, affinity_policy& policy) {
+	if (parse_affinity_policy(arg + 11, policy))
+		return true;
+	std::cerr << program_name << ": Invalid affinity policy '" << (arg + 11)
+	          << "'." << std::endl;
+	return false;
+}
+
+/**
+ * Describes the logical CPUs that the current process may run on.
+ */
+class cpu_topology {
+public:
+	struct cpu {
+		int id;
+		int package;
+		int core;
+		// The index of this hardware thread among its core's siblings.
+		int smt_index;
+		// The index of this CPU's core among its package's cores.
+		int core_index;
+	};
+
+	/**
+	 * Reads the topology of the CPUs in the calling thread's affinity mask
+	 * from sysfs.
+	 */
+	static cpu_topology current() {
+		cpu_topology topology;
+
+#if HAVE_THREAD_AFFINITY
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+			for (int id = 0; id < CPU_SETSIZE; id++) {
+				if (CPU_ISSET(id, &set))
+					topology.cpus_.push_back(cpu{id, read_topology_value(id, "physical_package_id", 0), read_topology_value(id, "core_id", id), 0, 0});
+			}
+		}
+#endif
+		if (topology.cpus_.empty()) {
+			const int count = std::max(1u, std::thread::hardware_concurrency());
+			for (int id = 0; id < count; id++)
+				topology.cpus_.push_back(cpu{id, 0, id, 0, 0});
+		}
+
+		// Number hardware threads within cores, and cores within packages.
+		std::sort(topology.cpus_.begin(), topology.cpus_.end(), [](const cpu& a, const cpu& b) {
+			return std::tie(a.package, a.core, a.id) < std::tie(b.package, b.core, b.id);
+		});
+		for (std::size_t i = 1; i < topology.cpus_.size(); i++) {
+			cpu& previous = topology.cpus_[i - 1];
+			cpu& current = topology.cpus_[i];
+			if (current.package != previous.package)
+				continue;
+			if (current.core == previous.core) {
+				current.smt_index = previous.smt_index + 1;
+				current.core_index = previous.core_index;
+			}
+			else {
+				current.core_index = previous.core_index + 1;
+			}
+		}
+
+		return topology;
+	}
+
+	/**
+	 * Returns the CPUs in (package, core, hardware thread) order.
+	 */
+	const std::vector<cpu>& cpus() const noexcept {
+		return cpus_;
+	}
+
+	/**
+	 * Returns the number of physical cores.
+	 */
+	std::size_t physical_core_count() const {
+		return std::count_if(cpus_.begin(), cpus_.end(), [](const cpu& c) { return c.smt_index == 0; });
+	}
+
+	/**
+	 * Returns the IDs of the CPUs that threads 0, 1, 2, ... should be pinned
+	 * to under @p policy. Thread i should be pinned to element
+	 * i % size() of the result. The result is empty if @p policy is
+	 * affinity_policy::none.
+	 */
+	std::vector<int> placement(affinity_policy policy) const {
+		std::vector<cpu> order;
+
+		switch (policy) {
+		case affinity_policy::none:
+			break;
+		case affinity_policy::compact:
+			order = cpus_;
+			break;
+		case affinity_policy::physical_cores:
+			std::copy_if(cpus_.begin(), cpus_.end(), std::back_inserter(order), [](const cpu& c) { return c.smt_index == 0; });
+			break;
+		case affinity_policy::scatter:
+			order = cpus_;
+			std::stable_sort(order.begin(), order.end(), [](const cpu& a, const cpu& b) {
+				return std::tie(a.smt_index, a.core_index, a.package) < std::tie(b.smt_index, b.core_index, b.package);
+			});
+			break;
+		}
+
+		std::vector<int> ids;
+		ids.reserve(order.size());
+		for (const cpu& c : order)
+			ids.push_back(c.id);
+		return ids;
+	}
+
+private:
+	std::vector<cpu> cpus_;
+
+	static int read_topology_value(int id, const char* name, int default_value) {
+		char path[96];
+		std::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", id, name);
+		int value = default_value;
+		if (std::FILE* file = std::fopen(path, "r")) {
+			if (std::fscanf(file, "%d", &value) != 1)
+				value = default_value;
+			std::fclose(file);
+		}
+		return value;
+	}
+};
+
+/**
+ * Pins the calling thread to the CPU with the given ID. Returns false if the
+ * thread could not be pinned.
+ */
+inline bool pin_current_thread(int cpu_id) {
+#if HAVE_THREAD_AFFINITY
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu_id, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	static_cast<void>(cpu_id);
+	return false;
+#endif
+}
+
+/**
+ * Pins the calling process (the calling thread, and the threads that it
+ * creates afterwards) to the CPUs with the given IDs. Returns false if it
+ * could not be pinned.
+ */
+inline bool pin_current_process(const std::vector<int>& cpu_ids) {
+#if HAVE_THREAD_AFFINITY
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int id : cpu_ids) {
+		if (id >= 0 && id < CPU_SETSIZE)
+			CPU_SET(id, &set);
+	}
+	return CPU_COUNT(&set) > 0 && sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+	static_cast<void>(cpu_ids);
+	return false;
+#endif
+}
+
+/**
+ * A NUMA node and the CPUs that belong to it.
+ */
+struct numa_node {
+	int id;
+	std::vector<int> cpus;
+};
+
+/**
+ * Returns the NUMA nodes that have CPUs in the calling thread's affinity
+ * mask, in order of their IDs, each with those of its CPUs. The result is
+ * empty if the NUMA topology cannot be read.
+ */
+inline std::vector<numa_node> numa_nodes() {
+	std::vector<numa_node> nodes;
+
+#if HAVE_THREAD_AFFINITY
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) != 0)
+		return nodes;
+
+	DIR* directory = opendir("/sys/devices/system/node");
+	if (!directory)
+		return nodes;
+	while (const dirent* entry = readdir(directory)) {
+		int id;
+		char end;
+		if (std::sscanf(entry->d_name, "node%d%c", &id, &end) != 1)
+			continue;
+
+		// Parse the node's CPU list, such as "0-3,8-11".
+		const std::string path = std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist";
+		numa_node node = {id, std::vector<int>()};
+		if (std::FILE* file = std::fopen(path.c_str(), "r")) {
+			int first, last;
+			while (std::fscanf(file, "%d", &first) == 1) {
+				last = first;
+				if (std::fscanf(file, "-%d", &last) != 1)
+					last = first;
+				for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+					if (CPU_ISSET(cpu, &set))
+						node.cpus.push_back(cpu);
+				}
+				if (std::fgetc(file) != ',')
+					break;
+			}
+			std::fclose(file);
+		}
+		if (!node.cpus.empty())
+			nodes.push_back(node);
+	}
+	closedir(directory);
+
+	std::sort(nodes.begin(), nodes.end(), [](const numa_node& a, const numa_node& b) {
+		return a.id < b.id;
+	});
+#endif
+	return nodes;
+}
+
+/**
+ * Returns the number of threads to use when the user does not specify one:
+ * the number of physical cores under affinity_policy::physical_cores, or
+ * @p processor_count otherwise.
+ */
+inline std::size_t default_thread_count(affinity_policy policy, std::size_t processor_count) {
+	if (policy == affinity_policy::physical_cores)
+		return cpu_topology::current().physical_core_count();
+	return processor_count;
+}
+
+/**
+ * Returns a thread pool initializer that pins worker i to the i-th CPU of
+ * the placement for @p policy, or an empty function if @p policy is
+ * affinity_policy::none.
+ */
+inline std::function<void(std::size_t)> make_affinity_initializer(affinity_policy policy) {
+	if (policy == affinity_policy::none)
+		return nullptr;
+	const std::vector<int> cpu_ids = cpu_topology::current().placement(policy);
+	return [cpu_ids](std::size_t i) {
+		pin_current_thread(cpu_ids[i % cpu_ids.size()]);
+	};
+}
+
+#endif // AFFINITY_HPP
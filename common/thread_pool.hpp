@@ -0,0 +1,348 @@
+/**
+ * @file		thread_pool.hpp
+ * A header-only work-stealing thread pool shared by the multithreaded
+ * homework programs.
+ *
+ * Each worker thread owns a task deque. Tasks submitted by a worker are
+ * pushed onto the back of its own deque and popped from the back (LIFO),
+ * while idle workers steal from the front of other workers' deques (FIFO).
+ * Tasks submitted by threads outside the pool are distributed round-robin.
+ *
+ * @author		Jennifer Yao
+ * @date		2015
+ * @copyright	All rights reserved.
+ */
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <cstddef>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * A single-use countdown synchronization primitive, similar to the
+ * std::latch class of later C++ standards.
+ */
+class latch {
+public:
+	explicit latch(std::ptrdiff_t count) : count_(count) {}
+
+	latch(const latch&) = delete;
+	latch& operator=(const latch&) = delete;
+
+	/**
+	 * Decrements the internal counter by @p n, and wakes up all waiting
+	 * threads if the counter reaches zero.
+	 */
+	void count_down(std::ptrdiff_t n = 1) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		count_ -= n;
+		if (count_ <= 0)
+			cv_.notify_all();
+	}
+
+	/**
+	 * Returns true if the internal counter has reached zero.
+	 */
+	bool try_wait() const {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return count_ <= 0;
+	}
+
+	/**
+	 * Blocks the calling thread until the internal counter reaches zero.
+	 */
+	void wait() const {
+		std::unique_lock<std::mutex> lock(mutex_);
+		cv_.wait(lock, [this] { return count_ <= 0; });
+	}
+
+	/**
+	 * Blocks the calling thread until the internal counter reaches zero or
+	 * the given duration elapses. Returns true if the counter reached zero.
+	 */
+	template<class Rep, class Period>
+	bool wait_for(const std::chrono::duration<Rep, Period>& duration) const {
+		std::unique_lock<std::mutex> lock(mutex_);
+		return cv_.wait_for(lock, duration, [this] { return count_ <= 0; });
+	}
+
+private:
+	mutable std::mutex mutex_;
+	mutable std::condition_variable cv_;
+	std::ptrdiff_t count_;
+};
+
+/**
+ * A fixed-size pool of persistent worker threads with per-worker task
+ * deques and work stealing.
+ */
+class thread_pool {
+public:
+	typedef std::function<void()> task_type;
+	typedef std::function<void(std::size_t)> initializer_type;
+
+	/**
+	 * Starts @p thread_count worker threads. If @p initializer is not empty,
+	 * each worker thread calls it with its index before running any tasks.
+	 * @pre @p thread_count != 0.
+	 */
+	explicit thread_pool(std::size_t thread_count, initializer_type initializer = nullptr) : queues_(), workers_(), initializer_(std::move(initializer)), mutex_(), cv_(), pending_count_(0), next_queue_(0), stopping_(false) {
+		queues_.reserve(thread_count);
+		for (std::size_t i = 0; i < thread_count; i++)
+			queues_.emplace_back(new task_queue);
+		workers_.reserve(thread_count);
+		for (std::size_t i = 0; i < thread_count; i++)
+			workers_.emplace_back(&thread_pool::worker_main, this, i);
+	}
+
+	thread_pool(const thread_pool&) = delete;
+	thread_pool& operator=(const thread_pool&) = delete;
+
+	/**
+	 * Runs all remaining tasks, then joins the worker threads.
+	 */
+	~thread_pool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stopping_ = true;
+		}
+		cv_.notify_all();
+		for (std::thread& worker : workers_)
+			worker.join();
+	}
+
+	/**
+	 * Returns the number of worker threads.
+	 */
+	std::size_t size() const noexcept {
+		return workers_.size();
+	}
+
+	/**
+	 * Returns true if the calling thread is a worker thread of this pool.
+	 */
+	bool is_worker_thread() const noexcept {
+		return current_pool() == this;
+	}
+
+	/**
+	 * Returns the index of the calling worker thread, in [0, size()).
+	 * @pre is_worker_thread().
+	 */
+	std::size_t worker_index() const noexcept {
+		return current_index();
+	}
+
+	/**
+	 * Schedules @p f(@p args...) for execution on the pool and returns a
+	 * future that holds its result.
+	 */
+	template<class F, class... Args>
+	std::future<typename std::result_of<F(Args...)>::type> submit(F&& f, Args&&... args) {
+		typedef typename std::result_of<F(Args...)>::type result_type;
+		std::shared_ptr<std::packaged_task<result_type()>> task =
+			std::make_shared<std::packaged_task<result_type()>>(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+		std::future<result_type> future = task->get_future();
+		push([task] { (*task)(); });
+		return future;
+	}
+
+	/**
+	 * Schedules @p task for execution on the pool without creating a
+	 * future. Exceptions thrown by @p task terminate the program.
+	 */
+	void push(task_type task) {
+		const std::size_t index = is_worker_thread()
+			? current_index()
+			: next_queue_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+		{
+			std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+			queues_[index]->tasks.push_back(std::move(task));
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			pending_count_++;
+		}
+		cv_.notify_one();
+	}
+
+	/**
+	 * Runs one pending task on the calling thread, if there is one. Returns
+	 * true if a task was run.
+	 */
+	bool run_pending_task() {
+		task_type task;
+		if (!pop_task(is_worker_thread() ? current_index() : 0, task))
+			return false;
+		task();
+		return true;
+	}
+
+	/**
+	 * Waits for @p future to become ready. If the calling thread is a worker
+	 * thread of this pool, it runs pending tasks while it waits instead of
+	 * blocking, so that tasks which wait on other tasks cannot deadlock the
+	 * pool.
+	 */
+	template<class T>
+	void wait(const std::future<T>& future) {
+		help_until([&future] {
+			return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+		}, [&future] {
+			future.wait_for(std::chrono::microseconds(100));
+		});
+		future.wait();
+	}
+
+	/**
+	 * Waits for @p done to reach zero. See wait(const std::future<T>&).
+	 */
+	void wait(const latch& done) {
+		help_until([&done] {
+			return done.try_wait();
+		}, [&done] {
+			done.wait_for(std::chrono::microseconds(100));
+		});
+		done.wait();
+	}
+
+private:
+	struct task_queue {
+		std::mutex mutex;
+		std::deque<task_type> tasks;
+	};
+
+	std::vector<std::unique_ptr<task_queue>> queues_;
+	std::vector<std::thread> workers_;
+	initializer_type initializer_;
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::atomic<std::ptrdiff_t> pending_count_;
+	std::atomic<std::size_t> next_queue_;
+	bool stopping_;
+
+	static const thread_pool*& current_pool() noexcept {
+		static thread_local const thread_pool* pool = nullptr;
+		return pool;
+	}
+
+	static std::size_t& current_index() noexcept {
+		static thread_local std::size_t index = 0;
+		return index;
+	}
+
+	// Pops a task from the back of queue @p index, or steals one from the
+	// front of another queue if that one is empty.
+	bool pop_task(std::size_t index, task_type& task) {
+		if (pending_count_.load(std::memory_order_acquire) <= 0)
+			return false;
+		{
+			task_queue& own = *queues_[index];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (!own.tasks.empty()) {
+				task = std::move(own.tasks.back());
+				own.tasks.pop_back();
+				pending_count_--;
+				return true;
+			}
+		}
+		for (std::size_t i = 1; i < queues_.size(); i++) {
+			task_queue& victim = *queues_[(index + i) % queues_.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.tasks.empty()) {
+				task = std::move(victim.tasks.front());
+				victim.tasks.pop_front();
+				pending_count_--;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	template<class Predicate, class Backoff>
+	void help_until(Predicate done, Backoff backoff) {
+		if (!is_worker_thread())
+			return;
+		while (!done()) {
+			if (!run_pending_task())
+				backoff();
+		}
+	}
+
+	void worker_main(std::size_t index) {
+		current_pool() = this;
+		current_index() = index;
+		if (initializer_)
+			initializer_(index);
+
+		task_type task;
+		for (;;) {
+			if (pop_task(index, task)) {
+				task();
+				task = nullptr;
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (stopping_ && pending_count_ <= 0)
+				break;
+			cv_.wait(lock, [this] { return stopping_ || pending_count_ > 0; });
+		}
+	}
+};
+
+/**
+ * Applies @p fn to consecutive chunks of [@p first, @p last) in parallel on
+ * @p pool, and waits for all of them to finish. Each chunk spans at most
+ * @p grain_size indices, and @p fn is called as fn(chunk_first, chunk_last).
+ * If any call to @p fn throws, the first exception thrown is rethrown once
+ * all chunks have finished.
+ * @pre @p grain_size != 0.
+ */
+template<class Index, class Function>
+void parallel_for(thread_pool& pool, Index first, Index last, Index grain_size, Function fn) {
+	if (!(first < last))
+		return;
+
+	const Index chunk_count = (last - first + grain_size - 1) / grain_size;
+
+	latch done(static_cast<std::ptrdiff_t>(chunk_count));
+	std::mutex exception_mutex;
+	std::exception_ptr exception;
+
+	for (Index chunk_first = first; chunk_first < last; ) {
+		const Index chunk_last = last - chunk_first > grain_size ? chunk_first + grain_size : last;
+		pool.push([&, chunk_first, chunk_last] {
+			try {
+				fn(chunk_first, chunk_last);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(exception_mutex);
+				if (!exception)
+					exception = std::current_exception();
+			}
+			done.count_down();
+		});
+		chunk_first = chunk_last;
+	}
+
+	pool.wait(done);
+
+	if (exception)
+		std::rethrow_exception(exception);
+}
+
+#endif // THREAD_POOL_HPP
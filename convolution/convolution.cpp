@@ -12,14 +12,17 @@
 
 #include <cinttypes>
 #include <cstdlib>
+#include <cstring>
 #include <algorithm>
-#include <future>
 #include <iostream>
 
 #include <boost/gil/extension/io/jpeg_io.hpp>
 #include <boost/gil/extension/numeric/kernel.hpp>
 #include <boost/gil/extension/numeric/convolve.hpp>
 
+#include "affinity.hpp"
+#include "thread_pool.hpp"
+
 // A convenience binary function wrapper for boost::gil::convolve_rows_fixed()
 // and boost::gil::convolve_cols_fixed().
 template<class PixelAccum, class Kernel>
@@ -40,6 +43,27 @@ template<class CharT, class Traits>
 void show_usage(std::basic_ostream<CharT, Traits>& out);
 
 int main(int argc, char* argv[]) {
+	affinity_policy affinity = affinity_policy::none;
+
+	// Parse command-line options, and remove them from argv so that only the
+	// positional arguments remain.
+	int arg_count = 1;
+	for (int i = 1; i < argc; i++) {
+		if (is_affinity_option(argv[i])) {
+			if (!parse_affinity_option(PACKAGE_NAME, argv[i], affinity))
+				return 1;
+		}
+		else if (std::strncmp(argv[i], "--", 2) == 0) {
+			std::cerr << PACKAGE_NAME << ": Unrecognized option '" << argv[i]
+			          << "'." << std::endl;
+			return 1;
+		}
+		else {
+			argv[arg_count++] = argv[i];
+		}
+	}
+	argc = arg_count;
+
 	if (argc != 4) {
 		show_usage(std::cerr);
 		return 1;
@@ -75,7 +99,7 @@ int main(int argc, char* argv[]) {
 	}
 
 	if (thread_count == 0)
-		thread_count = std::min(PTRDIFF_C(CPU_COUNT), image.height());
+		thread_count = std::min(static_cast<std::ptrdiff_t>(default_thread_count(affinity, PROCESSOR_COUNT)), image.height());
 
 	if (thread_count > image.height()) {
 		std::cerr << PACKAGE_NAME
@@ -96,35 +120,20 @@ int main(int argc, char* argv[]) {
 	boost::gil::kernel_1d_fixed<double, 9> kernel(gaussian_1, 4);
 
 	// Divide the input image into horizontal slices, one for each thread.
-	const auto slice_div = std::div(image.height(), thread_count);
-
-	std::vector<boost::gil::rgb8c_view_t> src_slices;
-	std::vector<boost::gil::rgb8_view_t> dst_slices;
-	src_slices.reserve(thread_count);
-	dst_slices.reserve(thread_count);
-
-	std::vector<std::future<void>> convolve_futures(thread_count);
-
-	for (std::size_t i = 0; i < thread_count; i++) {
-		typedef typename boost::gil::rgb8_view_t::point_t point_t;
-		const std::ptrdiff_t slice_height = slice_div.quot + (i == 0 ? slice_div.rem : 0);
-		const std::ptrdiff_t slice_y = i * slice_height + (i > 0 ? slice_div.rem : 0);
-		const point_t size(image.width(), slice_height);
-		const point_t offset(0, slice_y);
-		src_slices.push_back(boost::gil::subimage_view(const_image_view, offset, size));
-		dst_slices.push_back(boost::gil::subimage_view(image_view, offset, size));
-	}
+	// Every row costs the same to convolve, so there is nothing to gain from
+	// finer-grained chunks.
+	const std::ptrdiff_t slice_height = (image.height() + thread_count - 1) / thread_count;
 
 	// Perform the convolution operation on each slice.
-	for (std::size_t i = 0; i < thread_count; i++) {
-		convolve_futures[i] = std::async(std::launch::async,
-		                                 convolve_fixed_fn<boost::gil::rgb32f_pixel_t, decltype(kernel)>(kernel, boost::gil::convolve_option_extend_constant),
-		                                 src_slices[i],
-		                                 dst_slices[i]);
-	}
-
-	for (std::future<void>& convolve_future : convolve_futures)
-		convolve_future.wait();
+	thread_pool pool(thread_count, make_affinity_initializer(affinity));
+	parallel_for(pool, PTRDIFF_C(0), image.height(), slice_height, [&](std::ptrdiff_t first, std::ptrdiff_t last) {
+		typedef typename boost::gil::rgb8_view_t::point_t point_t;
+		const point_t size(image.width(), last - first);
+		const point_t offset(0, first);
+		convolve_fixed_fn<boost::gil::rgb32f_pixel_t, decltype(kernel)> convolve_fn(kernel, boost::gil::convolve_option_extend_constant);
+		convolve_fn(boost::gil::subimage_view(const_image_view, offset, size),
+		            boost::gil::subimage_view(image_view, offset, size));
+	});
 
 	// Write the output image.
 	try {
@@ -141,11 +150,14 @@ int main(int argc, char* argv[]) {
 
 template<class CharT, class Traits>
 void show_usage(std::basic_ostream<CharT, Traits>& out) {
-	out << "Usage: " << PACKAGE_NAME << " <input file> <output file> <number of threads>\n"
+	out << "Usage: " << PACKAGE_NAME << " [options] <input file> <output file> <number of threads>\n"
 	    << "Apply a very basic Gaussian blur effect on the image <input file> using a\n"
 	    << "convolution algorithm that executes <number of threads> tasks in parallel,\n"
 	    << "and write the result to <output file>.\n\n"
-	    << "If the specified number of threads is 0, the program uses " << CPU_COUNT << " by default.\n\n"
-	    << "NOTE: The input file must be a color JPEG image."
-	    << std::endl;
+	    << "If the specified number of threads is 0, the program uses " << PROCESSOR_COUNT << " by default\n"
+	    << "(or the number of physical cores with --affinity=physical-cores).\n\n"
+	    << "NOTE: The input file must be a color JPEG image.\n\n"
+	    << "Options:\n"
+	    << AFFINITY_OPTION_USAGE
+	    << std::flush;
 }
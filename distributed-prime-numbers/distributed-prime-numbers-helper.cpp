@@ -2,9 +2,10 @@
  * @file		distributed-prime-numbers-helper.cpp
  * A helper program for 'distributed-prime-numbers'.
  *
- * Defines the main entry point of a program that receives a range of
- * integers from 'distributed-prime-numbers' and performs primality testing
- * on that range.
+ * Defines the main entry point of a worker process that receives ranges of
+ * integers from a shared memory segment created by 'distributed-prime-numbers'
+ * (or, with --connect, from a coordinating 'distributed-prime-numbers' over
+ * TCP) and performs primality testing on those ranges.
  *
  * This program is meant to be run only by 'distributed-prime-numbers'.
  *
@@ -16,15 +17,76 @@
 #include "config.hpp"
 
 #include <cinttypes>
+#include <climits>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <iterator>
+#include <memory>
 #include <random>
+#include <string>
+#include <vector>
 
-#include <boost/interprocess/sync/named_semaphore.hpp>
+#include <fcntl.h>
+#include <unistd.h>
 
+#include "partition.hpp"
+#include "prime_table.hpp"
+#include "process.hpp"
+#include "protocol.hpp"
+#include "ring_buffer.hpp"
 #include "shared_memory.hpp"
+#include "affinity.hpp"
+#include "socket.hpp"
+#include "thread_pool.hpp"
 
 #define PRIMALITY_TEST_COUNT 100
 
+// The number of pieces per thread into which a range is split when a worker
+// process tests it with several threads, and the granularity of the pieces:
+// each one covers whole cache lines of the bitmap, so no two threads write
+// to the same byte.
+#define PIECES_PER_THREAD 4
+#define PIECE_ALIGNMENT (CHAR_BIT * kCacheLineSize)
+
+// An idle worker runs a backup of a range once the range has been claimed
+// for SPECULATION_FACTOR times as long as the worker took for its last range.
+#define SPECULATION_FACTOR 2
+
+// The number of points below the limit at which --calibrate measures the
+// cost of testing integers, the number of integers tested at each point, and
+// the number of times each is measured (the fastest time is kept).
+#define CALIBRATION_POINTS 8
+#define CALIBRATION_SAMPLE_SIZE 4096
+#define CALIBRATION_REPEATS 3
+
+// The number of integers tested between two heartbeats.
+#define HEARTBEAT_INTERVAL 4096
+
+// The interval, in microseconds, at which an idle worker checks for
+// re-dispatched ranges and for the driver's stop flag.
+#define kIdlePollInterval 1000
+
+// The integers that are tested for small prime factors before any Fermat
+// tests: the circumference of the 2-3-5 wheel, and the bound of the primes
+// used by passes_prefilter().
+#define WHEEL_SIZE 30
+#define SMALL_PRIME_LIMIT 102
+
+// wheel[n % WHEEL_SIZE] is true if n is coprime to 2, 3 and 5.
+static const bool wheel[WHEEL_SIZE] = {
+	false, true,  false, false, false, false, false, true,  false, false,
+	false, true,  false, true,  false, false, false, true,  false, true,
+	false, false, false, true,  false, false, false, false, false, true
+};
+
+// The primes less than SMALL_PRIME_LIMIT.
+static const std::uintmax_t small_primes[] = {
+	2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 67, 71,
+	73, 79, 83, 89, 97, 101
+};
+
 template<class CharT, class Traits>
 void show_usage(std::basic_ostream<CharT, Traits>& out);
 
@@ -33,22 +95,110 @@ IntType random_int(IntType min, IntType max);
 
 std::uintmax_t mod_pow(std::uintmax_t x, std::uintmax_t y, std::uintmax_t n);
 
+std::uintmax_t gcd(std::uintmax_t a, std::uintmax_t b);
+
+bool passes_prefilter(std::uintmax_t n);
+
 bool is_prime(std::uintmax_t n);
 
+template<class Heartbeat>
+bool test_range(std::uint64_t offset, std::uint64_t size, unsigned char* bitmap, Heartbeat heartbeat);
+
+template<class Heartbeat>
+bool test_range(thread_pool* pool, std::uint64_t offset, std::uint64_t size, unsigned char* bitmap, Heartbeat heartbeat);
+
+std::size_t render_primes(const unsigned char* bitmap, std::uint64_t offset, std::uint64_t size, char* text, std::uint64_t& prime_count);
+
+std::uint64_t find_straggler(const shared_segment& segment, std::uint64_t worker_id, std::uint64_t min_age);
+
+bool is_valid_segment(const segment_header& header);
+
+std::unique_ptr<thread_pool> start_worker(int node, std::uintmax_t thread_count);
+
+int run_worker(shared_segment& segment, std::uint64_t worker_id, int node, std::uintmax_t thread_count);
+
+int run_zygote(const std::string& run_id, std::uintmax_t thread_count);
+
+int run_calibration(std::uint64_t limit);
+
+int run_remote_worker(const char* address, thread_pool* pool);
+
 int main(int argc, char* argv[]) {
-	if (argc != 4) {
+	std::uintmax_t thread_count = 1;
+	const char* connect_address = nullptr;
+	int node = -1;
+	bool zygote = false;
+	std::uintmax_t calibration_limit = 0;
+
+	// Parse command-line options, and remove them from argv so that only the
+	// positional arguments remain.
+	int arg_count = 1;
+	for (int i = 1; i < argc; i++) {
+		if (std::strncmp(argv[i], "--threads=", 10) == 0) {
+			char* thread_count_end;
+			thread_count = std::strtoumax(argv[i] + 10, &thread_count_end, 10);
+			if (thread_count_end == argv[i] + 10 || *thread_count_end != '\0' || thread_count == 0) {
+				std::cerr << PACKAGE_NAME << "-helper: Invalid thread count '"
+				          << (argv[i] + 10) << "'." << std::endl;
+				return 1;
+			}
+		}
+		else if (std::strncmp(argv[i], "--node=", 7) == 0) {
+			char* node_end;
+			const long value = std::strtol(argv[i] + 7, &node_end, 10);
+			if (node_end == argv[i] + 7 || *node_end != '\0' || value < 0 || value > INT_MAX) {
+				std::cerr << PACKAGE_NAME << "-helper: Invalid NUMA node '"
+				          << (argv[i] + 7) << "'." << std::endl;
+				return 1;
+			}
+			node = static_cast<int>(value);
+		}
+		else if (std::strncmp(argv[i], "--connect=", 10) == 0) {
+			connect_address = argv[i] + 10;
+		}
+		else if (std::strcmp(argv[i], "--zygote") == 0) {
+			zygote = true;
+		}
+		else if (std::strncmp(argv[i], "--calibrate=", 12) == 0) {
+			char* calibration_limit_end;
+			calibration_limit = std::strtoumax(argv[i] + 12, &calibration_limit_end, 10);
+			if (calibration_limit_end == argv[i] + 12 || *calibration_limit_end != '\0' || calibration_limit == 0) {
+				std::cerr << PACKAGE_NAME << "-helper: Invalid calibration limit '"
+				          << (argv[i] + 12) << "'." << std::endl;
+				return 1;
+			}
+		}
+		else if (std::strncmp(argv[i], "--", 2) == 0) {
+			std::cerr << PACKAGE_NAME << "-helper: Unrecognized option '"
+			          << argv[i] << "'." << std::endl;
+			return 1;
+		}
+		else {
+			argv[arg_count++] = argv[i];
+		}
+	}
+	argc = arg_count;
+
+	if (calibration_limit != 0 && !connect_address && !zygote && argc == 1)
+		return run_calibration(calibration_limit);
+
+	if (connect_address && !zygote && calibration_limit == 0 && argc == 1) {
+		std::unique_ptr<thread_pool> pool = start_worker(node, thread_count);
+		return run_remote_worker(connect_address, pool.get());
+	}
+
+	if (zygote && !connect_address && calibration_limit == 0 && argc == 2)
+		return run_zygote(argv[1], thread_count);
+
+	if (connect_address || zygote || calibration_limit != 0 || argc != 3) {
 		show_usage(std::cerr);
 		return 1;
 	}
 
 	// Parse command-line arguments.
-	char* range_id_end;
-	char* offset_end;
-	char* size_end;
+	char* worker_id_end;
 
-	const std::intmax_t range_id = std::strtoimax(argv[1], &range_id_end, 10);
-	const std::intmax_t offset = std::strtoimax(argv[2], &offset_end, 10);
-	const std::intmax_t size = std::strtoimax(argv[3], &size_end, 10);
+	const std::intmax_t worker_id = std::strtoimax(argv[1], &worker_id_end, 10);
 
 #define check_argument(var, arg_idx) \
 	do { \
@@ -65,33 +215,483 @@ int main(int argc, char* argv[]) {
 	} \
 	while (false)
 
-	check_argument(range_id, 1);
-	check_argument(offset, 2);
-	check_argument(size, 3);
+	check_argument(worker_id, 1);
 
-	// Open the shared memory segment.
-	boost::interprocess::managed_shared_memory segment(boost::interprocess::open_only, kSharedMemorySegmentName);
+	// Open the shared memory segment of the run with the given ID, and check
+	// that it was created by a compatible driver.
+	const std::string run_id = argv[2];
+	shared_segment segment = shared_segment::open(segment_name(run_id));
+	if (!is_valid_segment(segment.header()) || static_cast<std::uint64_t>(worker_id) >= segment.header().worker_count) {
+		std::cerr << PACKAGE_NAME << "-helper: The shared memory segment is invalid."
+		          << std::endl;
+		return 1;
+	}
+
+	return run_worker(segment, worker_id, node, thread_count);
+}
+
+template<class CharT, class Traits>
+void show_usage(std::basic_ostream<CharT, Traits>& out) {
+	out << "Usage: " << PACKAGE_NAME << "-helper [options] <worker-id> <run-id>\n"
+	    << "   or: " << PACKAGE_NAME << "-helper [options] --zygote <run-id>\n"
+	    << "   or: " << PACKAGE_NAME << "-helper [options] --connect=<host>:<port>\n"
+	    << "   or: " << PACKAGE_NAME << "-helper --calibrate=<limit>\n"
+	    << "Claim ranges of integers from the shared memory segment of the driver's run\n"
+	    << "<run-id> and test them for primality until the driver signals that every\n"
+	    << "range is done.\n\n"
+	    << "With --zygote, open the segment once, and fork such a worker process for\n"
+	    << "every request that the driver writes to standard input.\n\n"
+	    << "With --connect, lease ranges from a driver started with --listen on\n"
+	    << "<host>:<port> instead, and send the results back over TCP.\n\n"
+	    << "With --calibrate, measure the cost of testing integers below <limit>, and\n"
+	    << "write the coefficients of the fitted cost model to standard output.\n\n"
+	    << "Options:\n"
+	    << "  --threads=<n>        Test each range with <n> threads (default: 1).\n"
+	    << "  --node=<id>          Run on the CPUs of NUMA node <id> only."
+	    << std::endl;
+}
+
+// Tests the integers in [offset, offset + size) for primality and stores the
+// results in the packed bitmap @p bitmap of bitmap_size(size) bytes. Integers that are not coprime to
+// WHEEL_SIZE are skipped without calling is_prime(), except for 2, 3 and 5
+// themselves. heartbeat() is called every HEARTBEAT_INTERVAL integers; if it
+// returns false, testing stops and false is returned.
+template<class Heartbeat>
+bool test_range(std::uint64_t offset, std::uint64_t size, unsigned char* bitmap, Heartbeat heartbeat) {
+	std::fill_n(bitmap, bitmap_size(size), 0);
+	std::size_t residue = offset % WHEEL_SIZE;
+	for (std::size_t i = 0; i < size; i++) {
+		if (i % HEARTBEAT_INTERVAL == HEARTBEAT_INTERVAL - 1 && !heartbeat())
+			return false;
+		if ((wheel[residue] || offset + i < WHEEL_SIZE) && is_prime(offset + i))
+			bitmap[i / CHAR_BIT] |= 1u << (i % CHAR_BIT);
+		if (++residue == WHEEL_SIZE)
+			residue = 0;
+	}
+	return true;
+}
 
-	// Open the semaphore.
-	boost::interprocess::named_semaphore n_done(boost::interprocess::open_only, kSemaphoreName);
+// Tests a range like test_range() above, but if @p pool is not null, splits
+// it into pieces that the threads of @p pool test in parallel. heartbeat()
+// may be called from any of them.
+template<class Heartbeat>
+bool test_range(thread_pool* pool, std::uint64_t offset, std::uint64_t size, unsigned char* bitmap, Heartbeat heartbeat) {
+	if (!pool)
+		return test_range(offset, size, bitmap, heartbeat);
 
-	shm_vector<bool>* prime_tables = segment.find<shm_vector<bool>>(kPrimeTableArrayName).first;
+	const std::uint64_t piece_count = pool->size() * PIECES_PER_THREAD;
+	const std::uint64_t piece_size = align<PIECE_ALIGNMENT>((size + piece_count - 1) / piece_count);
+	std::atomic<bool> tested(true);
+	parallel_for<std::uint64_t>(*pool, 0, size, piece_size, [&](std::uint64_t first, std::uint64_t last) {
+		if (tested.load(std::memory_order_relaxed) && !test_range(offset + first, last - first, bitmap + first / CHAR_BIT, heartbeat))
+			tested.store(false, std::memory_order_relaxed);
+	});
+	return tested.load(std::memory_order_relaxed);
+}
 
-	// Perform primality testing on selected range.
-	for (std::size_t i = 0; i < size; i++)
-		prime_tables[range_id][i] = is_prime(offset + i);
+// Writes the primes marked in the packed bitmap of the range
+// [offset, offset + size) to @p text in decimal, one per line, and stores
+// their number in @p prime_count. Returns the number of characters written,
+// which is at most max_text_size(size, offset + size).
+std::size_t render_primes(const unsigned char* bitmap, std::uint64_t offset, std::uint64_t size, char* text, std::uint64_t& prime_count) {
+	char* out = text;
+	prime_count = 0;
+	for (std::uint64_t i = 0; i < bitmap_size(size); i++) {
+		if (bitmap[i] == 0)
+			continue;
+		for (unsigned bit = 0; bit < CHAR_BIT; bit++) {
+			if (!(bitmap[i] & (1u << bit)))
+				continue;
+			// Write the digits backwards into a buffer, then copy them.
+			char digits[20];
+			char* digit = std::end(digits);
+			for (std::uint64_t n = offset + i * CHAR_BIT + bit; ; n /= 10) {
+				*--digit = static_cast<char>('0' + n % 10);
+				if (n < 10)
+					break;
+			}
+			out = std::copy(digit, std::end(digits), out);
+			*out++ = '\n';
+			prime_count++;
+		}
+	}
+	return out - text;
+}
 
-	// Signal the driver that primality testing is done on this range.
-	n_done.post();
+// Returns the ID of the range that has been claimed the longest by a worker
+// other than @p worker_id among those that may be claimed, if it has been
+// for more than @p min_age nanoseconds and has no backup yet, or kNoRangeId.
+std::uint64_t find_straggler(const shared_segment& segment, std::uint64_t worker_id, std::uint64_t min_age) {
+	const segment_header& header = segment.header();
+	const dispatch_state& dispatch = segment.dispatch();
+	const range_status* statuses = segment.range_statuses();
+	const std::uint64_t first = dispatch.printed.load(std::memory_order_acquire);
+	const std::uint64_t last = claimed_end(header, dispatch);
+	const std::uint64_t now = heartbeat_now();
+
+	std::uint64_t straggler = kNoRangeId;
+	std::uint64_t oldest_claim = now - std::min(now, min_age);
+	for (std::uint64_t i = first; i < last; i++) {
+		const std::uint64_t state = statuses[i].state.load(std::memory_order_acquire);
+		const std::uint64_t claimed_at = statuses[i].claimed_at.load(std::memory_order_relaxed);
+		if ((state & kRangeStateMask) == kRangeClaimed && claimed_at != 0 && claimed_at < oldest_claim && statuses[i].backup.load(std::memory_order_relaxed) != state && statuses[i].owner.load(std::memory_order_relaxed) != worker_id) {
+			straggler = i;
+			oldest_claim = claimed_at;
+		}
+	}
+	return straggler;
+}
+
+// Returns true if the shared memory segment with @p header was created by
+// a compatible driver.
+bool is_valid_segment(const segment_header& header) {
+	return header.magic == kSegmentMagic && header.version == kSegmentVersion;
+}
+
+// Prepares the calling process to test ranges: pins it to the CPUs of NUMA
+// node @p node, unless it is -1, and returns a pool of @p thread_count
+// threads, or null if @p thread_count is 1.
+std::unique_ptr<thread_pool> start_worker(int node, std::uintmax_t thread_count) {
+	// Pin the process before any threads are started, so that they inherit
+	// the mask, and the memory that they touch first is allocated on the
+	// node. If the node does not exist, the process runs unpinned.
+	if (node != -1) {
+		for (const numa_node& n : numa_nodes()) {
+			if (n.id == node)
+				pin_current_process(n.cpus);
+		}
+	}
+
+	// With more than one thread, every range is split among the threads of
+	// a pool; the main thread only claims ranges and publishes results.
+	std::unique_ptr<thread_pool> pool;
+	if (thread_count > 1)
+		pool.reset(new thread_pool(thread_count));
+	return pool;
+}
+
+// Runs worker process @p worker_id of the run whose shared memory segment is
+// @p segment: claims and tests ranges until the driver sets the stop flag.
+int run_worker(shared_segment& segment, std::uint64_t worker_id, int node, std::uintmax_t thread_count) {
+	std::unique_ptr<thread_pool> pool = start_worker(node, thread_count);
+	const segment_header& header = segment.header();
+	worker_slot& slot = segment.worker_slots()[worker_id];
+	dispatch_state& dispatch = segment.dispatch();
+	range_status* statuses = segment.range_statuses();
+	const std::uint64_t* range_offsets = segment.range_offsets();
+	mpmc_ring<std::uint64_t>* retry_queue = segment.retry_queue();
+	spsc_ring* results = segment.result_ring(worker_id);
+
+	slot.pid.store(getpid(), std::memory_order_relaxed);
+
+	// If the driver wants text, ranges are tested into a bitmap of this
+	// process first, and then rendered into the result slot. With the table
+	// format, the bitmap is stored in the prime table just before the result
+	// is published, and only while this worker still holds the claim on the
+	// range, so that a copy whose claim has expired never writes to it.
+	std::vector<unsigned char> bitmap;
+	if (header.result_format != kResultBitmap)
+		bitmap.resize(bitmap_size(header.max_range_size));
+	std::unique_ptr<shared_segment> table;
+	std::atomic<std::uint64_t>* table_words = nullptr;
+	if (header.result_format == kResultTable) {
+		table.reset(new shared_segment(shared_segment::open_file(header.table_path)));
+		const prime_table_header& table_header = *table->at<prime_table_header>(0);
+		if (table->size() < sizeof(prime_table_header) || table_header.version != kTableVersion || table_header.limit < header.max_prime || table_header.table_size > table->size()) {
+			std::cerr << PACKAGE_NAME << "-helper: The prime table is invalid."
+			          << std::endl;
+			return 1;
+		}
+		table_words = table->at<std::atomic<std::uint64_t>>(table_header.bitmap_offset);
+	}
+
+	// The driver sets the stop flag when it is done with the worker
+	// processes. If it dies before that, they are re-parented, and exit too.
+	const pid_t driver_pid = getppid();
+	const auto stopping = [&dispatch, driver_pid] {
+		return dispatch.stop.load(std::memory_order_acquire) || getppid() != driver_pid;
+	};
+
+	// The time that this worker took for its last range, or 0.
+	std::uint64_t last_range_duration = 0;
+
+	// With static assignment, the ranges of this worker's share are pushed
+	// onto its work deque as the claim window reaches them, in reverse, so
+	// that this worker pops them in order while idle workers steal the last
+	// ones. own_range is the next range of the share that is not pushed yet.
+	// The deque of a worker process that this one replaces may still hold
+	// ranges, which this one claims first.
+	work_deque<std::uint64_t>* deque = segment.work_deque_of(worker_id);
+	deque->recover();
+	std::uint64_t own_range = worker_id;
+	const auto take_static_range = [&](std::uint64_t window_end, std::uint64_t& range_id) {
+		if (deque->try_pop(range_id))
+			return true;
+
+		// Skip the part of the share that has been printed already.
+		const std::uint64_t printed = dispatch.printed.load(std::memory_order_acquire);
+		if (own_range < printed)
+			own_range += (printed - own_range + header.worker_count - 1) / header.worker_count * header.worker_count;
+		std::uint64_t count = 0;
+		while (count < kWorkDequeCapacity && own_range + count * header.worker_count < window_end)
+			count++;
+		for (std::uint64_t i = count; i-- > 0; )
+			deque->try_push(own_range + i * header.worker_count);
+		own_range += count * header.worker_count;
+		if (count != 0 && deque->try_pop(range_id))
+			return true;
+
+		// Steal from the others, starting with the next worker.
+		for (std::uint64_t i = 1; i < header.worker_count; i++) {
+			if (segment.work_deque_of((worker_id + i) % header.worker_count)->try_steal(range_id)) {
+#if !defined(NDEBUG) && defined(VERBOSE)
+				std::cerr << "Worker " << worker_id << " stole range "
+				          << range_id << "." << std::endl;
+#endif
+				return true;
+			}
+		}
+		return false;
+	};
+
+	// Without static assignment, takes the range at the cursor, unless it
+	// lies beyond the claim window. The cursor only advances while it is
+	// inside the window, so that racing workers cannot push it past the
+	// window (or the last range).
+	const auto take_next_range = [&](std::uint64_t window_end, std::uint64_t& range_id) {
+		range_id = dispatch.next_range.load(std::memory_order_relaxed);
+		while (range_id < window_end) {
+			if (dispatch.next_range.compare_exchange_weak(range_id, range_id + 1, std::memory_order_relaxed))
+				return true;
+		}
+		return false;
+	};
+
+	// Claim and test ranges until the driver sets the stop flag. Ranges that
+	// the driver has re-dispatched are claimed before new ones, and new ones
+	// (from the cursor, or from this worker's own share or those of others)
+	// only within the claim window. If there are none, run a backup of the range that has
+	// been claimed the longest, if it takes unusually long.
+	for (;;) {
+		if (stopping())
+			break;
+
+		// Wait for a free slot in the result ring before claiming a range,
+		// so that a claimed range never waits for the driver.
+		void* result_slot = results->try_reserve();
+		if (!result_slot) {
+			usleep(kIdlePollInterval);
+			continue;
+		}
+
+		std::uint64_t range_id;
+		std::uint64_t claim;
+		const std::uint64_t window_end = std::min<std::uint64_t>(header.range_count, dispatch.printed.load(std::memory_order_acquire) + header.claim_window);
+		if (retry_queue->try_pop(range_id)) {
+			if (!claim_range(statuses[range_id], worker_id, claim))
+				continue;
+		}
+		else if (header.static_assignment && take_static_range(window_end, range_id)) {
+			// Ranges that are already done or claimed, such as those that
+			// were handed to others, cannot be claimed, and are skipped.
+			if (!claim_range(statuses[range_id], worker_id, claim))
+				continue;
+		}
+		else if (!header.static_assignment && take_next_range(window_end, range_id)) {
+			if (!claim_range(statuses[range_id], worker_id, claim))
+				continue;
+		}
+		else if (header.speculation && last_range_duration != 0 && (range_id = find_straggler(segment, worker_id, SPECULATION_FACTOR * last_range_duration)) != kNoRangeId) {
+			if (!back_up_range(statuses[range_id], claim))
+				continue;
+#if !defined(NDEBUG) && defined(VERBOSE)
+			std::cerr << "Worker " << worker_id << " backing up range "
+			          << range_id << "." << std::endl;
+#endif
+		}
+		else {
+			usleep(kIdlePollInterval);
+			continue;
+		}
+
+		range_status& status = statuses[range_id];
+		result_header& result = *static_cast<result_header*>(result_slot);
+		result.range_id = range_id;
+		result.offset = range_offsets[range_id];
+		result.size = range_offsets[range_id + 1] - result.offset;
+		slot.current_range.store(range_id, std::memory_order_relaxed);
+		const std::uint64_t started = heartbeat_now();
+
+		// Test the range. Update the heartbeat and the progress counter while
+		// testing, and give up on the range as soon as the driver has
+		// re-dispatched it or stopped.
+		unsigned char* data = reinterpret_cast<unsigned char*>(&result + 1);
+		const std::uint64_t numbers_tested = slot.numbers_tested.load(std::memory_order_relaxed);
+		const bool tested = test_range(pool.get(), result.offset, result.size, bitmap.empty() ? data : bitmap.data(), [&status, &slot, &stopping, claim] {
+			status.heartbeat.store(heartbeat_now(), std::memory_order_relaxed);
+			slot.numbers_tested.fetch_add(HEARTBEAT_INTERVAL, std::memory_order_relaxed);
+			return holds_claim(status, claim) && !stopping();
+		});
+		slot.current_range.store(kNoRangeId, std::memory_order_relaxed);
+		if (!tested)
+			continue;
+		if (bitmap.empty()) {
+			result.prime_count = 0;
+			result.data_size = bitmap_size(result.size);
+		}
+		else if (header.result_format == kResultText) {
+			result.data_size = render_primes(bitmap.data(), result.offset, result.size, reinterpret_cast<char*>(data), result.prime_count);
+		}
+		else if (header.result_format == kResultReduce) {
+			reduce_record& record = *reinterpret_cast<reduce_record*>(data);
+			reduce_primes(bitmap.data(), result.offset, result.size, record);
+			result.prime_count = record.prime_count;
+			result.data_size = sizeof(reduce_record);
+			if (result.offset + result.size > header.reduce_bitmap_from) {
+				std::copy(bitmap.begin(), bitmap.begin() + bitmap_size(result.size), data + sizeof(reduce_record));
+				result.data_size += bitmap_size(result.size);
+			}
+		}
+		else {
+			result.prime_count = 0;
+			result.data_size = 0;
+		}
+		if (!holds_claim(status, claim))
+			continue;
+		if (table_words)
+			store_range(table_words, bitmap.data(), result.offset, result.size);
+		last_range_duration = heartbeat_now() - started;
+
+		// The heartbeats counted whole intervals only.
+		slot.numbers_tested.store(numbers_tested + result.size, std::memory_order_relaxed);
+		slot.ranges_done.fetch_add(1, std::memory_order_relaxed);
+
+		// Publish the result before marking the range done, so that a range
+		// is never done without its result having been published: if this
+		// worker process dies or stalls in between, the range is still
+		// claimed, and the driver re-dispatches it. A worker and its backup,
+		// or a worker whose claim expires after the check above, may both
+		// publish a result for the range; the driver ignores the second.
+		results->commit();
+		complete_range(status, claim);
+		signal_completion(dispatch);
+	}
 
 	return 0;
 }
 
-template<class CharT, class Traits>
-void show_usage(std::basic_ostream<CharT, Traits>& out) {
-	out << "Usage: " << PACKAGE_NAME << "-helper <range-id> <offset> <size>\n"
-	    << "Test the integers in range [<offset>, <size>) for primality."
-	    << std::endl;
+// Runs as the zygote of the run with the given ID: opens its shared memory
+// segment once, then reads zygote_requests from standard input
+// and forks a worker process for each, whose process ID (or -1) it writes to
+// standard output. The worker processes are forked as children of the
+// driver, so that the driver waits for them as for any other. Returns once
+// standard input is closed.
+int run_zygote(const std::string& run_id, std::uintmax_t thread_count) {
+#if HAVE_FORK_SIBLING
+	try {
+		shared_segment segment = shared_segment::open(segment_name(run_id));
+		if (!is_valid_segment(segment.header())) {
+			std::cerr << PACKAGE_NAME << "-helper: The shared memory segment is invalid."
+			          << std::endl;
+			return 1;
+		}
+		zygote_request request;
+		while (receive_all(STDIN_FILENO, &request, sizeof(request))) {
+			std::int64_t pid = -1;
+			if (request.worker_id < segment.header().worker_count)
+				pid = fork_sibling();
+			if (pid == 0) {
+				// Let go of the zygote's socket, so that the driver sees it
+				// closed as soon as the zygote exits.
+				const int null_fd = open("/dev/null", O_RDWR);
+				if (null_fd != -1) {
+					dup2(null_fd, STDIN_FILENO);
+					dup2(null_fd, STDOUT_FILENO);
+					close(null_fd);
+				}
+				int status = 1;
+				try {
+					status = run_worker(segment, request.worker_id, static_cast<int>(request.node), thread_count);
+				}
+				catch (const std::exception& exception) {
+					std::cerr << PACKAGE_NAME << "-helper: error: " << exception.what()
+					          << std::endl;
+				}
+				_exit(status);
+			}
+			send_all(STDOUT_FILENO, &pid, sizeof(pid));
+		}
+	}
+	catch (const std::exception& exception) {
+		std::cerr << PACKAGE_NAME << "-helper: error: " << exception.what()
+		          << std::endl;
+		return 1;
+	}
+	return 0;
+#else
+	(void) run_id;
+	(void) thread_count;
+	std::cerr << PACKAGE_NAME << "-helper: --zygote is not supported on this system."
+	          << std::endl;
+	return 1;
+#endif
+}
+
+// Measures the cost of testing integers at CALIBRATION_POINTS points up to
+// limit, and writes the cost model fitted to the measurements (see
+// partition.hpp) to standard output as '<fixed> <per-log-squared>'.
+int run_calibration(std::uint64_t limit) {
+	std::vector<cost_sample> samples;
+	std::vector<unsigned char> bitmap(bitmap_size(CALIBRATION_SAMPLE_SIZE));
+	for (std::uint64_t i = 1; i <= CALIBRATION_POINTS; i++) {
+		const std::uint64_t end = limit / CALIBRATION_POINTS * i;
+		const std::uint64_t size = std::min<std::uint64_t>(end, CALIBRATION_SAMPLE_SIZE);
+		if (size == 0)
+			continue;
+		std::uint64_t fastest = UINT64_MAX;
+		for (int j = 0; j < CALIBRATION_REPEATS; j++) {
+			const std::uint64_t started = heartbeat_now();
+			test_range(end - size, size, bitmap.data(), [] { return true; });
+			fastest = std::min(fastest, heartbeat_now() - started);
+		}
+		samples.push_back(cost_sample{end - size / 2.0, fastest / (size * kWheelDensity)});
+	}
+
+	const cost_model model = fit_cost_model(samples);
+	std::cout << model.fixed << ' ' << model.per_log_squared << std::endl;
+	return 0;
+}
+
+// Connects to a coordinating driver at @p address (<host>:<port>), and tests
+// the ranges that it leases until it sends a done frame.
+int run_remote_worker(const char* address, thread_pool* pool) {
+	std::string host, port;
+	if (!parse_address(address, host, port)) {
+		std::cerr << PACKAGE_NAME << "-helper: Invalid address '" << address
+		          << "'." << std::endl;
+		return 1;
+	}
+
+	try {
+		socket_handle socket = connect_tcp(host, port);
+		send_hello(socket.get());
+
+		std::vector<unsigned char> bitmap;
+		frame f;
+		while (receive_frame(socket.get(), f) && f.type != message_type::done) {
+			const lease_message lease = decode_lease(f);
+			bitmap.resize(bitmap_size(lease.size));
+			test_range(pool, lease.offset, lease.size, bitmap.data(), [] { return true; });
+			send_result(socket.get(), lease.range_id, bitmap);
+		}
+	}
+	catch (const std::exception& exception) {
+		std::cerr << PACKAGE_NAME << "-helper: error: " << exception.what()
+		          << std::endl;
+		return 1;
+	}
+
+	return 0;
 }
 
 // Generates random integers in a thread-safe manner.
@@ -102,21 +702,70 @@ IntType random_int(IntType min, IntType max) {
 	return uniform_dist(generator);
 }
 
-// Precondition: n != 0.
+// Returns a * b % n without overflowing, however large n is.
+// Precondition: a < n and b < n.
+std::uintmax_t mul_mod(std::uintmax_t a, std::uintmax_t b, std::uintmax_t n) {
+#if HAVE_UNSIGNED_INT128
+	return static_cast<std::uintmax_t>(static_cast<unsigned __int128>(a) * b % n);
+#else
+	// Add a doubling a for each bit of b, reducing after every step.
+	std::uintmax_t result = 0;
+	while (b != 0) {
+		if (b & 1)
+			result = result >= n - a ? result - (n - a) : result + a;
+		a = a >= n - a ? a - (n - a) : a + a;
+		b >>= 1;
+	}
+	return result;
+#endif
+}
+
+// Precondition: n != 0 and x < n.
 std::uintmax_t mod_pow(std::uintmax_t x, std::uintmax_t y, std::uintmax_t n) {
 	if (y == 0)
-		return 1;
-	std::uintmax_t z = mod_pow(x, y / 2, n);
+		return 1 % n;
+	const std::uintmax_t z = mod_pow(x, y / 2, n);
+	const std::uintmax_t z_squared = mul_mod(z, z, n);
 	if (y % 2 == 0)
-		return z * z % n;
-	return x * z * z % n;
+		return z_squared;
+	return mul_mod(x, z_squared, n);
+}
+
+std::uintmax_t gcd(std::uintmax_t a, std::uintmax_t b) {
+	while (b != 0) {
+		const std::uintmax_t r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+// Returns true if @p n may be prime, or false if it has a prime factor less
+// than SMALL_PRIME_LIMIT. Multiples of 2, 3 and 5 are assumed to have been
+// skipped by the wheel already.
+// Precondition: n >= SMALL_PRIME_LIMIT.
+bool passes_prefilter(std::uintmax_t n) {
+#if HAVE_UNSIGNED_INT128
+	// The product of the primes from 7 to 101, which fits in 128 bits.
+	static constexpr unsigned __int128 small_prime_product = (static_cast<unsigned __int128>(UINT64_C(0x05d6ec0849b19b04)) << 64) | UINT64_C(0xec36b9eeafbfe991);
+	return gcd(n, static_cast<std::uintmax_t>(small_prime_product % n)) == 1;
+#else
+	// The product of the primes from 7 to 47, which fits in 64 bits.
+	static constexpr std::uint64_t small_prime_product = UINT64_C(0x0048d14ccb92cf27);
+	return gcd(n, small_prime_product % n) == 1;
+#endif
 }
 
 // NOTE: Implemented using Fermat's little theorem. The probability of the
 // primality test returning a false positive is 1 / 2^k, where
 // k = PRIMALITY_TEST_COUNT.
+// Before any Fermat tests are done, n is checked for small prime factors:
+// multiples of 2, 3 and 5 are rejected by the wheel, and multiples of the
+// other primes less than SMALL_PRIME_LIMIT by passes_prefilter().
 bool is_prime(std::uintmax_t n) {
-	if (n < 2)
+	if (n < SMALL_PRIME_LIMIT)
+		return std::binary_search(std::begin(small_primes), std::end(small_primes), n);
+	if (!wheel[n % WHEEL_SIZE] || !passes_prefilter(n))
 		return false;
 	for (std::size_t i = 0; i < PRIMALITY_TEST_COUNT; i++) {
 		const std::uintmax_t a = random_int<std::uintmax_t>(1, n - 1);
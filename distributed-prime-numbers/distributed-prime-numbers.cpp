@@ -3,7 +3,12 @@
  * A multi-process version of the 'prime-numbers' program.
  *
  * Defines the main entry point of a program that spawns a number of worker
- * processes that perform primality testing on ranges of integers.
+ * processes that perform primality testing on ranges of integers. The worker
+ * processes receive ranges through shared memory or, with --listen, over TCP,
+ * in which case helpers on other hosts may join in as well. With --serve, the
+ * program instead keeps a table of the primes it finds resident in shared
+ * memory and answers queries about them over a Unix-domain socket. With
+ * --reduce, it only writes their count, sum or largest gap.
  *
  * @author		Jennifer Yao
  * @date		2015
@@ -13,39 +18,355 @@
 #include "config.hpp"
 
 #include <cinttypes>
+#include <climits>
 #include <cmath>
+#include <csignal>
 #include <cstdlib>
-#if !HAVE_STD_SNPRINTF
-#include <stdio.h>
-#else
-#include <cstdio>
-#endif
+#include <cstring>
 #include <algorithm>
+#include <deque>
+#include <functional>
+#include <iomanip>
 #include <iostream>
-#include <limits>
+#include <map>
+#include <memory>
+#include <sstream>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
-#include <boost/interprocess/sync/named_semaphore.hpp>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "affinity.hpp"
+#include "partition.hpp"
+#include "prime_table.hpp"
+#include "process.hpp"
+#include "protocol.hpp"
+#include "ring_buffer.hpp"
 #include "shared_memory.hpp"
+#include "socket.hpp"
 
-#if !HAVE_STD_SNPRINTF
-namespace std {
-	using ::snprintf;
-}
-#endif
+#define kHelperName PACKAGE_NAME "-helper"
+
+// The default number of ranges per process, which determines the default
+// chunk size.
+#define RANGES_PER_PROCESS 8
+
+// The largest default chunk size. It keeps the result slots, and so the
+// shared memory segment, small no matter how many primes are requested.
+#define MAX_DEFAULT_CHUNK_SIZE (UINTMAX_C(1) << 20)
+
+// The interval, in milliseconds, at which the driver checks whether a worker
+// process has failed while it waits for ranges to be done.
+#define kHelperPollInterval 100
+
+// The interval, in milliseconds, at which the driver reports the progress of
+// the worker processes with --progress.
+#define kProgressInterval 1000
+
+// The interval, in milliseconds, at which the driver checks whether the
+// worker processes have exited once every prime has been printed.
+#define kHelperShutdownPollInterval 5
+
+// The default number of seconds after which a range whose worker process
+// has stopped updating its heartbeat is re-dispatched to another one.
+#define kDefaultLeaseTimeout 10
+
+// The number of times a worker process that crashes is restarted.
+#define kMaxHelperRestarts 3
 
-static constexpr std::size_t max_command_length = 38 + 2 * std::numeric_limits<std::size_t>::digits10 + std::numeric_limits<std::uintmax_t>::digits10;
+// The time, in milliseconds, that worker processes are given to exit once
+// every range is done. Those that have not exited by then are killed.
+#define kHelperExitTimeout 1000
+
+// The time, in milliseconds, that the zygote is given to fork a worker
+// process, and to exit once it is stopped. A zygote that takes longer has
+// stalled; it is killed, and worker processes are started from scratch.
+#define kZygoteTimeout 1000
+
+// The longest query line that the daemon accepts, and the most primes that
+// it lists in answer to a single query. Clients that need more map the table.
+#define kMaxQueryLength 4096
+#define kMaxQueryResults (UINT64_C(1) << 20)
+
+// Receives the result of each range, in order, and the text or bitmap that
+// follows it. Returns true if no more ranges are needed.
+typedef std::function<bool(const result_header& result, const unsigned char* data)> result_sink;
+
+/**
+ * The options of a run, which main() fills in from the command line and
+ * passes to the backend that it runs: how the integers in [0, max_prime) are
+ * divided among process_count worker processes, and how those are run.
+ */
+struct run_options {
+	std::size_t process_count = 0;
+	std::uint64_t max_prime = 0;
+	// The average number of integers in a range.
+	std::uint64_t chunk_size = 0;
+	// The number of seconds after which a range whose worker process has
+	// stopped updating its heartbeat is re-dispatched to another one.
+	std::uint64_t lease_timeout = kDefaultLeaseTimeout;
+	// The number of threads with which each worker process tests ranges.
+	std::uintmax_t threads_per_process = 1;
+	// The NUMA nodes among which worker processes are placed with --numa,
+	// or none.
+	std::vector<numa_node> helper_nodes;
+	// False if idle worker processes may not run backups of slow ranges.
+	bool speculation = true;
+	// True if each worker process tests a fixed share of the ranges instead
+	// of claiming the next one from a shared cursor.
+	bool static_assignment = false;
+	// The model of the cost of testing integers by which ranges are planned.
+	cost_model range_cost_model = default_cost_model();
+	// True if the progress of the worker processes is reported on standard
+	// error.
+	bool show_progress = false;
+	// True if the shared memory segment and the prime table are backed by
+	// huge pages where possible.
+	bool use_huge_pages = false;
+	// The file in which --serve keeps its prime table, or empty if the table
+	// is kept in shared memory.
+	std::string table_path;
+	// With the reduce format, the integer above which a range may hold the
+	// last prime wanted. The results of such ranges carry their bitmap.
+	std::uint64_t reduce_bitmap_from = UINT64_MAX;
+};
 
 template<class CharT, class Traits>
 void show_usage(std::basic_ostream<CharT, Traits>& out);
 
 void clean_up();
 
+bool print_primes(const unsigned char* bitmap, std::uint64_t offset, std::uint64_t size, std::intmax_t& prime_count);
+
+int run_coordinator(const char* address, std::intmax_t prime_count, const run_options& options);
+
+void run_workers(const run_options& options, std::uint64_t result_format, const result_sink& sink);
+
+void write_all(int fd, const void* data, std::size_t size);
+
+int run_daemon(const char* socket_path, const run_options& options);
+
+int run_query(const char* socket_path, int argc, char* argv[]);
+
+int run_reduction(const std::string& reduction, std::intmax_t prime_count, run_options options);
+
+void merge_records(reduce_record& total, const reduce_record& next);
+
+std::string decimal_string(std::uint64_t high, std::uint64_t low);
+
+int helper_node(const run_options& options, std::size_t i);
+
+pid_t spawn_helper(const run_options& options, std::size_t i, std::vector<std::string> args);
+
+std::string locate_helper(const char* argv0);
+
+cost_model calibrate_cost_model(std::uint64_t max_prime);
+
+void report_progress(const shared_segment& segment, std::vector<std::uint64_t>& last_tested, std::uint64_t interval_ns);
+
+// The ID of this run, which makes the names of its IPC objects unique.
+std::string run_id;
+
+// The path of the helper program.
+std::string helper_path;
+
+/**
+ * The zygote of a run: a helper started with --zygote, which opens the
+ * shared memory segment of the run once, and then forks worker
+ * processes on request, far faster than they can be started from scratch.
+ * The driver sends it zygote_requests over a socket.
+ */
+class zygote_process {
+public:
+	zygote_process() noexcept : pid_(-1), socket_() {}
+
+	zygote_process(const zygote_process&) = delete;
+	zygote_process& operator=(const zygote_process&) = delete;
+
+	~zygote_process() {
+		stop();
+	}
+
+	// Starts the zygote of this run, whose segment must exist, and which
+	// tests ranges with threads_per_process threads in each worker process.
+	// If it cannot be started, fork_worker() fails.
+	void start(std::uintmax_t threads_per_process) {
+#if HAVE_FORK_SIBLING
+		try {
+			socket_handle zygote_socket;
+			socket_pair(socket_, zygote_socket);
+			set_socket_timeout(socket_.get(), kZygoteTimeout);
+			pid_ = spawn_process({helper_path, "--zygote", "--threads=" + std::to_string(threads_per_process), run_id}, zygote_socket.get(), zygote_socket.get());
+		}
+		catch (const std::system_error&) {
+			socket_.reset();
+		}
+#else
+		(void) threads_per_process;
+#endif
+	}
+
+	// Has the zygote fork worker process i, pinned to NUMA node node unless
+	// it is -1, and returns its process ID. On failure, including a zygote
+	// that does not answer within kZygoteTimeout, stops the zygote and
+	// returns -1.
+	pid_t fork_worker(std::size_t i, int node) {
+		if (pid_ == -1)
+			return -1;
+		const zygote_request request = {i, node};
+		std::int64_t pid = -1;
+		try {
+			send_all(socket_.get(), &request, sizeof(request));
+			if (!receive_all(socket_.get(), &pid, sizeof(pid)))
+				pid = -1;
+		}
+		catch (const std::system_error&) {
+			pid = -1;
+		}
+		if (pid <= 0) {
+			stop();
+			return -1;
+		}
+		return static_cast<pid_t>(pid);
+	}
+
+	// Closes the socket, upon which the zygote exits, and reaps it. A
+	// zygote that does not exit within kZygoteTimeout is killed.
+	void stop() noexcept {
+		socket_.reset();
+		if (pid_ == -1)
+			return;
+		try {
+			const std::uint64_t exit_deadline = heartbeat_now() + UINT64_C(1000000) * kZygoteTimeout;
+			int exit_status;
+			while (!try_wait_process(pid_, exit_status)) {
+				if (heartbeat_now() > exit_deadline) {
+					kill_process(pid_);
+					wait_process(pid_);
+					break;
+				}
+				usleep(kHelperShutdownPollInterval * 1000);
+			}
+		}
+		catch (const std::system_error&) {
+		}
+		pid_ = -1;
+	}
+
+private:
+	pid_t pid_;
+	socket_handle socket_;
+};
+
 int main(int argc, char* argv[]) {
 	std::atexit(clean_up);
 
-	if (argc != 3) {
+	run_options options;
+	std::uintmax_t chunk_size = 0;
+	std::uintmax_t lease_timeout = kDefaultLeaseTimeout;
+	const char* listen_address = nullptr;
+	const char* serve_path = nullptr;
+	const char* query_path = nullptr;
+	const char* reduction = nullptr;
+	bool use_numa = false;
+	bool calibrate = false;
+
+	// Parse command-line options, and remove them from argv so that only the
+	// positional arguments remain.
+	int arg_count = 1;
+	for (int i = 1; i < argc; i++) {
+		if (std::strncmp(argv[i], "--chunk=", 8) == 0) {
+			char* chunk_size_end;
+			chunk_size = std::strtoumax(argv[i] + 8, &chunk_size_end, 10);
+			if (chunk_size_end == argv[i] + 8 || *chunk_size_end != '\0' || chunk_size == 0) {
+				std::cerr << PACKAGE_NAME << ": Invalid chunk size '"
+				          << (argv[i] + 8) << "'." << std::endl;
+				return 1;
+			}
+		}
+		else if (std::strncmp(argv[i], "--lease-timeout=", 16) == 0) {
+			char* lease_timeout_end;
+			lease_timeout = std::strtoumax(argv[i] + 16, &lease_timeout_end, 10);
+			if (lease_timeout_end == argv[i] + 16 || *lease_timeout_end != '\0' || lease_timeout == 0) {
+				std::cerr << PACKAGE_NAME << ": Invalid lease timeout '"
+				          << (argv[i] + 16) << "'." << std::endl;
+				return 1;
+			}
+		}
+		else if (std::strncmp(argv[i], "--threads-per-process=", 22) == 0) {
+			char* threads_per_process_end;
+			options.threads_per_process = std::strtoumax(argv[i] + 22, &threads_per_process_end, 10);
+			if (threads_per_process_end == argv[i] + 22 || *threads_per_process_end != '\0' || options.threads_per_process == 0) {
+				std::cerr << PACKAGE_NAME << ": Invalid number of threads per process '"
+				          << (argv[i] + 22) << "'." << std::endl;
+				return 1;
+			}
+		}
+		else if (std::strcmp(argv[i], "--numa") == 0) {
+			use_numa = true;
+		}
+		else if (std::strcmp(argv[i], "--no-speculation") == 0) {
+			options.speculation = false;
+		}
+		else if (std::strcmp(argv[i], "--static") == 0) {
+			options.static_assignment = true;
+		}
+		else if (std::strcmp(argv[i], "--calibrate") == 0) {
+			calibrate = true;
+		}
+		else if (std::strcmp(argv[i], "--progress") == 0) {
+			options.show_progress = true;
+		}
+		else if (std::strcmp(argv[i], "--huge-pages") == 0) {
+			options.use_huge_pages = true;
+		}
+		else if (std::strncmp(argv[i], "--listen=", 9) == 0) {
+			listen_address = argv[i] + 9;
+		}
+		else if (std::strncmp(argv[i], "--serve=", 8) == 0) {
+			serve_path = argv[i] + 8;
+		}
+		else if (std::strncmp(argv[i], "--query=", 8) == 0) {
+			query_path = argv[i] + 8;
+		}
+		else if (std::strncmp(argv[i], "--reduce=", 9) == 0) {
+			reduction = argv[i] + 9;
+			if (std::strcmp(reduction, "count") != 0 && std::strcmp(reduction, "sum") != 0 && std::strcmp(reduction, "maxgap") != 0) {
+				std::cerr << PACKAGE_NAME << ": Invalid reduction '"
+				          << reduction << "'." << std::endl;
+				return 1;
+			}
+		}
+		else if (std::strncmp(argv[i], "--table-file=", 13) == 0) {
+			options.table_path = argv[i] + 13;
+			if (options.table_path.empty() || options.table_path.size() >= kMaxTablePathLength) {
+				std::cerr << PACKAGE_NAME << ": Invalid table file '"
+				          << options.table_path << "'." << std::endl;
+				return 1;
+			}
+		}
+		else if (std::strncmp(argv[i], "--", 2) == 0) {
+			std::cerr << PACKAGE_NAME << ": Unrecognized option '" << argv[i]
+			          << "'." << std::endl;
+			return 1;
+		}
+		else {
+			argv[arg_count++] = argv[i];
+		}
+	}
+	argc = arg_count;
+
+	if (query_path)
+		return run_query(query_path, argc, argv);
+
+	// The options that only apply to the shared memory backend are rejected
+	// with --listen, rather than ignored.
+	const bool shared_memory_options = serve_path || reduction || options.show_progress || options.use_huge_pages || options.static_assignment || !options.speculation || calibrate || lease_timeout != kDefaultLeaseTimeout;
+	if (argc != 3 || (listen_address && shared_memory_options) || (serve_path && reduction) || (!serve_path && !options.table_path.empty())) {
 		show_usage(std::cerr);
 		return 1;
 	}
@@ -80,7 +401,7 @@ int main(int argc, char* argv[]) {
 		return 0;
 
 	if (process_count == 0)
-		process_count = std::min(INTMAX_C(CPU_COUNT), prime_count);
+		process_count = std::min(static_cast<std::intmax_t>(PROCESSOR_COUNT), prime_count);
 
 	if (process_count > prime_count) {
 		std::cerr << PACKAGE_NAME
@@ -93,72 +414,783 @@ int main(int argc, char* argv[]) {
 	// number, where n is prime_count.
 	const std::uintmax_t max_prime = prime_count < 6 ? 12 : prime_count * (std::log(prime_count) + std::log(std::log(prime_count)));
 
-	// Divide the set of integers in [0, max_prime) into chunks/ranges, one
-	// for each process.
-	const auto range_div = std::div(max_prime, process_count);
+	// Divide the set of integers in [0, max_prime) into ranges of chunk_size
+	// integers on average. Worker processes claim ranges one at a time, so
+	// processes that run on faster or less busy cores simply claim more of
+	// them. By default, there are several ranges per process.
+	if (chunk_size == 0)
+		chunk_size = std::min((max_prime + process_count * RANGES_PER_PROCESS - 1) / (process_count * RANGES_PER_PROCESS), MAX_DEFAULT_CHUNK_SIZE);
+
+	// Name the IPC objects of this run after its process ID, and remove those
+	// left behind by runs that died.
+	run_id = std::to_string(getpid());
+	reap_stale_ipc_objects();
 
-	std::vector<std::size_t> range_sizes(process_count);
-	std::vector<std::uintmax_t> range_offsets(process_count);
+	helper_path = locate_helper(argv[0]);
+
+	options.process_count = process_count;
+	options.max_prime = max_prime;
+	options.chunk_size = chunk_size;
+	options.lease_timeout = lease_timeout;
+
+	// Measure the cost of testing integers on this host, instead of using
+	// the default cost model.
+	if (calibrate) {
+		try {
+			options.range_cost_model = calibrate_cost_model(max_prime);
+		}
+		catch (const std::exception& exception) {
+			std::cerr << PACKAGE_NAME << ": error: " << exception.what()
+			          << std::endl;
+			return 1;
+		}
+#if !defined(NDEBUG) && defined(VERBOSE)
+		std::cerr << "Cost model: " << options.range_cost_model.fixed << " + "
+		          << options.range_cost_model.per_log_squared << " ln^2(n) ns" << std::endl;
+#endif
+	}
+
+	if (use_numa)
+		options.helper_nodes = numa_nodes();
+
+	if (listen_address)
+		return run_coordinator(listen_address, prime_count, options);
+	if (serve_path)
+		return run_daemon(serve_path, options);
+	if (reduction)
+		return run_reduction(reduction, prime_count, options);
 
 	try {
-		// Create a new shared memory segment.
-		const std::size_t segment_size = process_count * align<kAlignment>((sizeof(shm_vector<bool>) + (range_div.quot + range_div.rem)));
+		// The worker processes render the primes as text, so the driver
+		// only copies it to standard output, up to the last prime wanted.
+		run_workers(options, kResultText, [&prime_count](const result_header& result, const unsigned char* text) {
+			if (result.prime_count < static_cast<std::uintmax_t>(prime_count)) {
+				write_all(STDOUT_FILENO, text, result.data_size);
+				prime_count -= result.prime_count;
+				return false;
+			}
+			const unsigned char* end = text;
+			for (std::intmax_t i = 0; i < prime_count; i++)
+				end = static_cast<const unsigned char*>(std::memchr(end, '\n', text + result.data_size - end)) + 1;
+			write_all(STDOUT_FILENO, text, end - text);
+			prime_count = 0;
+			return true;
+		});
+	}
+	catch (const std::exception& exception) {
+		std::cerr << PACKAGE_NAME << ": error: " << exception.what()
+		          << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+// Tests the integers in [0, options.max_prime) with options.process_count
+// worker processes that claim ranges of options.chunk_size integers on
+// average through shared memory, and passes the results, in result_format,
+// to sink in order as they arrive, until sink returns true or every range is
+// done. A range whose worker process fails or shows no progress for
+// options.lease_timeout seconds is re-dispatched to another one.
+// Throws an exception on failure.
+void run_workers(const run_options& options, std::uint64_t result_format, const result_sink& sink) {
+	const std::size_t process_count = options.process_count;
+	const std::uint64_t max_prime = options.max_prime;
+	const bool static_assignment = options.static_assignment;
+
+	// Plan the layout of the shared memory segment.
+	// Divide [0, max_prime) into ranges of chunk_size integers on average,
+	// which take about the same time to test according to the cost model
+	// (see partition.hpp), so ranges of larger integers are narrower. Every
+	// range starts on a byte of a packed bitmap, or with the table format,
+	// on a word of the table, which worker processes write concurrently.
+	const std::uint64_t alignment = result_format == kResultTable ? 64 : CHAR_BIT;
+	const std::vector<std::uint64_t> range_offsets = plan_ranges(options.range_cost_model, max_prime, (max_prime + options.chunk_size - 1) / options.chunk_size, alignment);
+	std::uint64_t max_range_size = 0;
+	for (std::size_t i = 0; i + 1 < range_offsets.size(); i++)
+		max_range_size = std::max(max_range_size, range_offsets[i + 1] - range_offsets[i]);
+
+	// Plan the layout of the shared memory segment. With huge pages, its
+	// page-aligned parts are aligned to huge pages, so that each result ring
+	// can still be placed on a NUMA node of its own.
+	segment_header layout;
+	const std::size_t page_size = options.use_huge_pages ? huge_page_size() : kAlignment;
+	plan_segment(layout, max_prime, range_offsets.size() - 1, max_range_size, process_count, result_format, page_size);
+	layout.speculation = options.speculation;
+	layout.static_assignment = static_assignment;
+	if (result_format == kResultTable) {
+		const std::size_t length = options.table_path.copy(layout.table_path, kMaxTablePathLength - 1);
+		layout.table_path[length] = '\0';
+	}
+	if (result_format == kResultReduce)
+		layout.reduce_bitmap_from = std::min(options.reduce_bitmap_from, max_prime);
+	const std::uint64_t range_count = layout.range_count;
 
 #if !defined(NDEBUG) && defined(VERBOSE)
-		std::cerr << "Shared memory segment size: " << segment_size << std::endl;
+	std::cerr << "Shared memory segment size: " << layout.segment_size << std::endl;
 #endif
 
-		boost::interprocess::managed_shared_memory segment(boost::interprocess::create_only, kSharedMemorySegmentName, segment_size);
+	// Create a new shared memory segment, which is zero-filled, and
+	// write the layout to it.
+	shared_segment segment = shared_segment::create(segment_name(run_id), layout.segment_size, options.use_huge_pages);
+	segment.header() = layout;
+	std::copy(range_offsets.begin(), range_offsets.end(), segment.range_offsets());
 
-		// Initialize shared memory allocator.
-		const shm_allocator<bool> default_allocator(segment.get_segment_manager());
+	worker_slot* slots = segment.worker_slots();
+	for (std::size_t i = 0; i < process_count; i++)
+		slots[i].current_range.store(kNoRangeId, std::memory_order_relaxed);
 
-		// Construct an array of shm_vector<bool> objects in shared memory that
-		// use the shared memory allocator.
-		shm_vector<bool>* prime_tables = segment.construct<shm_vector<bool>>(kPrimeTableArrayName)[process_count](default_allocator);
+	// Construct the queue of re-dispatched ranges, and one work deque and
+	// one result ring per worker process. The dispatch state and every range
+	// status start at 0 (no range claimed or printed, every range pending)
+	// in the zero-filled segment.
+	dispatch_state& dispatch = segment.dispatch();
+	range_status* statuses = segment.range_statuses();
+	mpmc_ring<std::uint64_t>* retry_queue = mpmc_ring<std::uint64_t>::create(segment.at<void>(layout.retry_queue_offset), layout.retry_queue_capacity);
+	for (std::size_t i = 0; i < process_count; i++)
+		work_deque<std::uint64_t>::create(segment.work_deque_of(i), kWorkDequeCapacity);
+	std::vector<spsc_ring*> result_rings;
+	for (std::size_t i = 0; i < process_count; i++) {
+		// The pages of a result ring are allocated on the NUMA node of its
+		// worker process, which writes them, rather than on the node of the
+		// driver, which touches the ring first.
+		if (helper_node(options, i) != -1)
+			prefer_node(segment.result_ring(i), layout.result_ring_stride, helper_node(options, i));
+		result_rings.push_back(spsc_ring::create(segment.result_ring(i), kResultRingCapacity, layout.result_slot_size));
+	}
 
-		for (std::size_t i = 0; i < process_count; i++) {
-			range_sizes[i]  = range_div.quot + (i == 0 ? range_div.rem : 0);
-			range_offsets[i] = i * range_sizes[i] + (i > 0 ? range_div.rem : 0);
-			prime_tables[i].assign(range_sizes[i], false);
+	// Launch the worker processes. Each one attaches to the shared memory
+	// segment of this run once, and then claims and tests ranges until the
+	// driver sets the stop flag. They are forked by the zygote, which has
+	// attached already, so that restarting one that crashed is cheap; if
+	// there is no zygote, they are started from scratch.
+	zygote_process zygote;
+	zygote.start(options.threads_per_process);
+	const auto spawn_worker = [&zygote, &options](std::size_t i) {
+		const pid_t pid = zygote.fork_worker(i, helper_node(options, i));
+		return pid != -1 ? pid : spawn_helper(options, i, {std::to_string(i), run_id});
+	};
+	std::vector<pid_t> helper_pids;
+	std::vector<bool> helper_reaped(process_count, false);
+	std::vector<bool> helper_stalled(process_count, false);
+	std::vector<unsigned> helper_restart_counts(process_count, 0);
+
+	// Tells the worker processes to exit, and reaps them, when this
+	// function returns or throws. Those that stalled are killed, since they
+	// may never exit on their own; so are those that do not exit in time,
+	// such as one that stalled on a range that a backup finished before its
+	// lease expired.
+	struct worker_shutdown {
+		dispatch_state& dispatch;
+		const std::vector<pid_t>& pids;
+		const std::vector<bool>& reaped;
+		const std::vector<bool>& stalled;
+
+		~worker_shutdown() {
+			dispatch.stop.store(1, std::memory_order_release);
+			signal_completion(dispatch);
+			const std::uint64_t exit_deadline = heartbeat_now() + UINT64_C(1000000) * kHelperExitTimeout;
+			for (std::size_t i = 0; i < pids.size(); i++) {
+				if (reaped[i])
+					continue;
+				if (stalled[i])
+					kill_process(pids[i]);
+				try {
+					int exit_status;
+					while (!try_wait_process(pids[i], exit_status)) {
+						if (heartbeat_now() > exit_deadline) {
+							kill_process(pids[i]);
+							wait_process(pids[i]);
+							break;
+						}
+						usleep(kHelperShutdownPollInterval * 1000);
+					}
+				}
+				catch (const std::system_error&) {
+				}
+			}
+		}
+	};
+	worker_shutdown stop_workers = {dispatch, helper_pids, helper_reaped, helper_stalled};
+
+	// With static assignment, the ranges of failed worker processes that
+	// have been handed to the others through the retry queue.
+	std::vector<bool> handed_over(static_assignment ? range_count : 0, false);
+	helper_pids.reserve(process_count);
+	for (std::size_t i = 0; i < process_count; i++)
+		helper_pids.push_back(spawn_worker(i));
+
+	// Returns a claimed range to the pending state and queues it for
+	// another worker process.
+	const auto redispatch = [&](std::uint64_t range_id) {
+		if (expire_range(statuses[range_id]))
+			retry_queue->push(range_id);
+	};
+
+	// Results that arrive before the ranges preceding them are kept here
+	// until they can be passed on. The claim window bounds their number.
+	struct early_result {
+		result_header header;
+		std::vector<unsigned char> data;
+	};
+	std::map<std::uint64_t, early_result> early_results;
+	std::uint64_t next_range = 0;
+	bool finished = false;
+
+	// Drain the result rings and pass results on in order as they arrive.
+	// At least every kHelperPollInterval milliseconds, check for worker
+	// processes that have crashed and for ranges whose heartbeat has
+	// stopped, and re-dispatch their ranges. Crashed worker processes are
+	// restarted up to kMaxHelperRestarts times; if every worker process is
+	// gone, throw a runtime_error exception.
+	const std::uint64_t poll_interval = UINT64_C(1000000) * kHelperPollInterval;
+	const std::uint64_t lease_timeout_ns = UINT64_C(1000000000) * options.lease_timeout;
+	std::uint64_t next_check = heartbeat_now() + poll_interval;
+
+	// The range that the driver is waiting for, and since when.
+	std::uint64_t head_range = 0;
+	std::uint64_t head_since = heartbeat_now();
+
+	// The progress counters of the worker processes at the last report, and
+	// its time.
+	const std::uint64_t progress_interval = UINT64_C(1000000) * kProgressInterval;
+	std::vector<std::uint64_t> last_tested(process_count, 0);
+	std::uint64_t last_report = heartbeat_now();
+
+	// The number of results that the worker processes had published when the
+	// driver last looked. The driver sleeps until it changes.
+	std::uint32_t completions = 0;
+	while (!finished && next_range < range_count) {
+		const bool woken = wait_for_completion(dispatch, completions, poll_interval);
+		completions = dispatch.completions.load(std::memory_order_acquire);
+
+		for (std::size_t i = 0; i < process_count && !finished; i++) {
+			while (const void* slot = result_rings[i]->front()) {
+				const result_header& result = *static_cast<const result_header*>(slot);
+				const unsigned char* data = reinterpret_cast<const unsigned char*>(&result + 1);
+#if !defined(NDEBUG) && defined(VERBOSE)
+				std::cerr << "Worker " << i << " finished range "
+				          << result.range_id << "." << std::endl;
+#endif
+				// The next range is passed on straight from the ring; later
+				// ones are copied out of it. Results for ranges that were
+				// re-dispatched may arrive twice.
+				if (result.range_id == next_range) {
+					finished = sink(result, data);
+					next_range++;
+				}
+				else if (result.range_id > next_range && result.range_id < range_count && !early_results.count(result.range_id)) {
+					early_results[result.range_id] = early_result{result, std::vector<unsigned char>(data, data + result.data_size)};
+				}
+				result_rings[i]->pop();
+				if (finished)
+					break;
+			}
+		}
+		for (auto it = early_results.begin(); !finished && it != early_results.end() && it->first == next_range; it = early_results.erase(it)) {
+			finished = sink(it->second.header, it->second.data.data());
+			next_range++;
+		}
+		dispatch.printed.store(next_range, std::memory_order_release);
+
+		// With static assignment, hand the pending ranges within the claim
+		// window of worker processes that are gone for good or stalled to
+		// the others, as the window moves, each one once. (Those that they
+		// have pushed onto their deques may be stolen as well; whoever claims
+		// them first tests them. A handed-over range that is claimed and
+		// then re-dispatched is queued again by redispatch().)
+		if (static_assignment) {
+			for (std::uint64_t j = next_range; j < claimed_end(layout, dispatch); j++) {
+				const std::size_t owner = j % process_count;
+				if (!handed_over[j] && (helper_reaped[owner] || helper_stalled[owner]) && (statuses[j].state.load(std::memory_order_acquire) & kRangeStateMask) == kRangePending)
+					handed_over[j] = retry_queue->try_push(j);
+			}
+		}
+
+		// The progress counters are read from the worker slots, so reports
+		// cost the worker processes nothing.
+		if (options.show_progress && heartbeat_now() - last_report >= progress_interval) {
+			const std::uint64_t now = heartbeat_now();
+			report_progress(segment, last_tested, now - last_report);
+			last_report = now;
 		}
 
-		// Create a semaphore to manage worker processes.
-		boost::interprocess::named_semaphore n_done(boost::interprocess::create_only, kSemaphoreName, 0);
+		if (woken && heartbeat_now() < next_check)
+			continue;
+		next_check = heartbeat_now() + poll_interval;
 
-		// Perform primality tests on each range of integers.
+		// Only ranges between the last one printed and the cursor (or the
+		// end of the claim window) can be claimed.
+		const std::uint64_t claimed_limit = claimed_end(layout, dispatch);
+
+		// Worker processes only exit on their own after the stop flag is
+		// set, so any that has exited by now has failed.
+		bool helpers_running = false;
 		for (std::size_t i = 0; i < process_count; i++) {
-			char command[max_command_length];
-			std::snprintf(command, max_command_length, "./" PACKAGE_NAME "-helper %zu %ju %zu", i, range_offsets[i], range_sizes[i]);
+			int exit_status;
+			if (!helper_reaped[i] && try_wait_process(helper_pids[i], exit_status)) {
+				helper_reaped[i] = true;
 #if !defined(NDEBUG) && defined(VERBOSE)
-			std::cerr << "Running '" << command << "'..." << std::endl;
+				std::cerr << "Worker " << i << " failed." << std::endl;
 #endif
-			// Launch a worker process.
-			// Throw a runtime_error exception if the worker process returns
-			// a nonzero exit status (hopefully this never happens).
-			if (std::system(command))
-				throw std::runtime_error(PACKAGE_NAME "-helper");
+				for (std::uint64_t j = next_range; j < claimed_limit; j++) {
+					if (statuses[j].owner.load(std::memory_order_relaxed) == i)
+						redispatch(j);
+				}
+				if (helper_restart_counts[i] < kMaxHelperRestarts) {
+					helper_restart_counts[i]++;
+					helper_pids[i] = spawn_worker(i);
+					helper_reaped[i] = false;
+				}
+			}
+			if (!helper_reaped[i])
+				helpers_running = true;
+		}
+		if (!helpers_running)
+			throw std::runtime_error(PACKAGE_NAME "-helper");
+
+		const std::uint64_t now = heartbeat_now();
+		for (std::uint64_t j = next_range; j < claimed_limit; j++) {
+			const std::uint64_t state = statuses[j].state.load(std::memory_order_acquire);
+			const std::uint64_t heartbeat = statuses[j].heartbeat.load(std::memory_order_relaxed);
+			if ((state & kRangeStateMask) == kRangeClaimed && heartbeat != 0 && heartbeat < now && now - heartbeat > lease_timeout_ns) {
+				const std::uint64_t owner = statuses[j].owner.load(std::memory_order_relaxed);
+#if !defined(NDEBUG) && defined(VERBOSE)
+				std::cerr << "Worker " << owner << " stalled on range " << j
+				          << "." << std::endl;
+#endif
+				if (owner < process_count)
+					helper_stalled[owner] = true;
+				redispatch(j);
+			}
+		}
+
+		// With static assignment, a worker process that stalls before it
+		// claims its next range shows no heartbeat, so one that has not
+		// claimed the range the driver is waiting for within the lease
+		// timeout counts as stalled too.
+		if (next_range != head_range) {
+			head_range = next_range;
+			head_since = now;
+		}
+		if (static_assignment) {
+			if (next_range < range_count && now - head_since > lease_timeout_ns && (statuses[next_range].state.load(std::memory_order_acquire) & kRangeStateMask) == kRangePending) {
+#if !defined(NDEBUG) && defined(VERBOSE)
+				std::cerr << "Worker " << next_range % process_count
+				          << " stalled before range " << next_range << "."
+				          << std::endl;
+#endif
+				helper_stalled[next_range % process_count] = true;
+			}
 		}
+	}
+
+	// The worker processes are told to exit and reaped by stop_workers.
+}
+
+template<class CharT, class Traits>
+void show_usage(std::basic_ostream<CharT, Traits>& out) {
+	out << "Usage: " << PACKAGE_NAME << " [options] <number of primes> <number of processes>\n"
+	    << "       " << PACKAGE_NAME << " --query=<path> <query>\n"
+	    << "Write the first <number of primes> prime numbers to standard output using an\n"
+	    << "algorithm that executes <number of processes> tasks in parallel.\n\n"
+	    << "If the specified number of processes is 0, the program uses " << PROCESSOR_COUNT << " by default.\n"
+	    << "Prime numbers are separated by newlines.\n\n"
+	    << "Options:\n"
+	    << "  --chunk=<n>          Have worker processes claim <n> integers at a time on\n"
+	    << "                       average (by default, about 1/" << RANGES_PER_PROCESS << " of each process's\n"
+	    << "                       share, but at most " << MAX_DEFAULT_CHUNK_SIZE << "). Ranges of larger\n"
+	    << "                       integers are narrower, so that every range takes\n"
+	    << "                       about the same time to test.\n"
+	    << "  --calibrate          Measure the cost of testing integers on this host\n"
+	    << "                       before dividing them into ranges, instead of using a\n"
+	    << "                       built-in estimate (not with --listen).\n"
+	    << "  --static             Have worker process i test ranges i, i + <number of\n"
+	    << "                       processes>, and so on, instead of claiming ranges\n"
+	    << "                       from a shared cursor; idle ones steal the ranges of\n"
+	    << "                       others that they have not claimed yet (not with\n"
+	    << "                       --listen).\n"
+	    << "  --progress           Report how many integers per second each worker process\n"
+	    << "                       tests, and how far along it is, on standard error\n"
+	    << "                       every second (not with --listen).\n"
+	    << "  --lease-timeout=<seconds>\n"
+	    << "                       Re-dispatch a range if its worker process shows no\n"
+	    << "                       progress for <seconds> seconds (default: " << kDefaultLeaseTimeout << ";\n"
+	    << "                       not with --listen).\n"
+	    << "  --threads-per-process=<n>\n"
+	    << "                       Have each worker process test ranges with <n> threads\n"
+	    << "                       (default: 1). With --listen, this applies to the\n"
+	    << "                       local worker processes only.\n"
+	    << "  --no-speculation     Do not let idle worker processes run backups of ranges\n"
+	    << "                       that take unusually long (not with --listen).\n"
+	    << "  --huge-pages         Back the shared memory of the run with huge pages from\n"
+	    << "                       the hugetlbfs mount, or failing that, ask for\n"
+	    << "                       transparent huge pages (not with --listen).\n"
+	    << "  --numa               Spread worker processes over the NUMA nodes, pin each\n"
+	    << "                       one to the CPUs of its node, and allocate its result\n"
+	    << "                       ring on that node. With --listen, the local worker\n"
+	    << "                       processes are only pinned.\n"
+	    << "  --listen=<host>:<port>\n"
+	    << "                       Lease ranges to worker processes over TCP instead of\n"
+	    << "                       shared memory. The local worker processes connect to\n"
+	    << "                       <host>:<port>, and so can helpers on other hosts\n"
+	    << "                       started with '" << PACKAGE_NAME << "-helper --connect=<host>:<port>'.\n"
+	    << "                       If <port> is 0, a free port is used; use\n"
+	    << "                       --listen=127.0.0.1:0 to run over loopback only.\n"
+	    << "  --serve=<path>       Keep the primes below the bound of the <number of\n"
+	    << "                       primes>th prime in shared memory, and answer queries\n"
+	    << "                       about them on a Unix-domain socket at <path> until\n"
+	    << "                       interrupted.\n"
+	    << "  --reduce=<aggregate> Write only the count, sum or largest gap of the first\n"
+	    << "                       <number of primes> primes, where <aggregate> is\n"
+	    << "                       'count', 'sum' or 'maxgap' (the gap, followed by the\n"
+	    << "                       primes on either side of the first largest gap).\n"
+	    << "  --table-file=<path>  With --serve, keep the table in a sparse file at <path>\n"
+	    << "                       instead of shared memory, so that it may be larger\n"
+	    << "                       than memory. The file is kept, and served again by\n"
+	    << "                       later runs that need no more primes.\n"
+	    << "  --query=<path>       Send <query> to the program serving at <path>, and\n"
+	    << "                       write the answer to standard output. <query> is one of\n"
+	    << "                       'is-prime <n>', 'count <a> <b>', 'range <a> <b>' (the\n"
+	    << "                       primes in [<a>, <b>)), 'first <n>' or 'map'."
+	    << std::endl;
+}
+
+// Returns the NUMA node on which worker process i is placed, or -1 if worker
+// processes are not placed on NUMA nodes.
+int helper_node(const run_options& options, std::size_t i) {
+	return options.helper_nodes.empty() ? -1 : options.helper_nodes[i % options.helper_nodes.size()].id;
+}
+
+// Starts worker process i with the given arguments, after the options that
+// apply to every worker process.
+pid_t spawn_helper(const run_options& options, std::size_t i, std::vector<std::string> args) {
+	args.insert(args.begin(), {helper_path, "--threads=" + std::to_string(options.threads_per_process)});
+	if (helper_node(options, i) != -1)
+		args.insert(args.begin() + 2, "--node=" + std::to_string(helper_node(options, i)));
+#if !defined(NDEBUG) && defined(VERBOSE)
+	std::cerr << "Running '" << args[0];
+	for (std::size_t i = 1; i < args.size(); i++)
+		std::cerr << ' ' << args[i];
+	std::cerr << "'..." << std::endl;
+#endif
+	return spawn_process(args);
+}
+
+// Writes all size bytes at data to the file descriptor fd. Throws a
+// system_error exception on failure.
+void write_all(int fd, const void* data, std::size_t size) {
+	const char* p = static_cast<const char*>(data);
+	while (size > 0) {
+		const ssize_t n = write(fd, p, size);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			throw std::system_error(errno, std::generic_category(), "write");
+		}
+		p += n;
+		size -= n;
+	}
+}
 
-		// Wait for worker processes to signal this program.
+// Returns the path of the helper program, which is installed next to the
+// driver, so that the driver can be run from any directory.
+std::string locate_helper(const char* argv0) {
+	std::string path = argv0;
+	char buffer[4096];
+	const ssize_t length = readlink("/proc/self/exe", buffer, sizeof(buffer));
+	if (length > 0 && static_cast<std::size_t>(length) < sizeof(buffer))
+		path.assign(buffer, length);
+	const std::string::size_type slash = path.rfind('/');
+	return slash == std::string::npos ? "./" kHelperName : path.substr(0, slash + 1) + kHelperName;
+}
+
+// Runs the helper program with --calibrate to measure the cost of testing
+// integers below max_prime on this host, and returns the fitted cost model.
+// Throws an exception on failure.
+cost_model calibrate_cost_model(std::uint64_t max_prime) {
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) == -1)
+		throw std::system_error(errno, std::generic_category(), "pipe2");
+	pid_t pid;
+	try {
+		pid = spawn_process({helper_path, "--calibrate=" + std::to_string(max_prime)}, -1, fds[1]);
+	}
+	catch (...) {
+		close(fds[0]);
+		close(fds[1]);
+		throw;
+	}
+	close(fds[1]);
+
+	std::string output;
+	char buffer[256];
+	ssize_t n;
+	while ((n = read(fds[0], buffer, sizeof(buffer))) != 0) {
+		if (n > 0)
+			output.append(buffer, n);
+		else if (errno != EINTR)
+			break;
+	}
+	close(fds[0]);
+
+	cost_model model;
+	std::istringstream in(output);
+	if (wait_process(pid) != 0 || !(in >> model.fixed >> model.per_log_squared))
+		throw std::runtime_error("calibration failed");
+	return model;
+}
+
+// Writes the progress of each worker process of the run whose segment is
+// segment to standard error: the number of integers per second that it has
+// tested since the last report, interval_ns nanoseconds ago, and the share of
+// the integers in [0, max_prime) that it has tested so far. last_tested holds
+// the progress counters at the last report, and is updated.
+void report_progress(const shared_segment& segment, std::vector<std::uint64_t>& last_tested, std::uint64_t interval_ns) {
+	const segment_header& header = segment.header();
+	const worker_slot* slots = segment.worker_slots();
+	const double seconds = interval_ns / 1e9;
+	std::ostringstream workers;
+	workers << std::fixed << std::setprecision(1);
+	double total_rate = 0;
+	double total_share = 0;
+	for (std::size_t i = 0; i < header.worker_count; i++) {
+		const std::uint64_t tested = slots[i].numbers_tested.load(std::memory_order_relaxed);
+		const double rate = (tested - last_tested[i]) / seconds;
+		const double share = 100.0 * tested / header.max_prime;
+		last_tested[i] = tested;
+		total_rate += rate;
+		total_share += share;
+		workers << "  worker " << i << ": " << std::min(share, 100.0) << "% done, "
+		        << static_cast<std::uint64_t>(rate) << " integers/s\n";
+	}
+
+	// Backups test some integers twice, so the shares may add up to more.
+	std::ostringstream report;
+	report << std::fixed << std::setprecision(1)
+	       << PACKAGE_NAME << ": " << std::min(total_share, 100.0) << "% done, "
+	       << static_cast<std::uint64_t>(total_rate) << " integers/s\n"
+	       << workers.str();
+	std::cerr << report.str() << std::flush;
+}
+
+// Writes the primes marked in the packed bitmap of the range
+// [offset, offset + size) to standard output, decrementing prime_count for
+// each one. Returns true once prime_count has reached 0.
+bool print_primes(const unsigned char* bitmap, std::uint64_t offset, std::uint64_t size, std::intmax_t& prime_count) {
+	for (std::uint64_t i = 0; i < size; i++) {
+		if (bitmap[i / CHAR_BIT] & (1u << (i % CHAR_BIT))) {
+			std::cout << (offset + i) << std::endl;
+			if (--prime_count == 0)
+				return true;
+		}
+	}
+	return false;
+}
+
+// Runs the driver as a TCP coordinator listening on address (<host>:<port>).
+// The integers in [0, max_prime) are divided into ranges of chunk_size
+// integers, which are leased to every helper that connects: the
+// process_count helpers started locally, and any started by hand on other
+// hosts. Ranges leased to a helper that disconnects are leased again to
+// others. Results are printed in order as soon as they arrive.
+int run_coordinator(const char* address, std::intmax_t prime_count, const run_options& options) {
+	const std::size_t process_count = options.process_count;
+	const std::uint64_t max_prime = options.max_prime;
+	const std::uint64_t chunk_size = options.chunk_size;
+
+	struct range_state {
+		std::vector<unsigned char> bitmap;
+		bool done;
+	};
+
+	struct connection {
+		socket_handle socket;
+		frame_reader reader;
+		// True once the helper has sent a valid hello frame.
+		bool ready;
+		std::vector<std::uint64_t> leases;
+	};
+
+	std::string host, port;
+	if (!parse_address(address, host, port)) {
+		std::cerr << PACKAGE_NAME << ": Invalid listen address '" << address
+		          << "'." << std::endl;
+		return 1;
+	}
+	if (8 + bitmap_size(chunk_size) > kMaxFramePayload) {
+		std::cerr << PACKAGE_NAME << ": The chunk size is too large for --listen."
+		          << std::endl;
+		return 1;
+	}
+
+	try {
+		const std::uint64_t range_count = (max_prime + chunk_size - 1) / chunk_size;
+		std::vector<range_state> ranges(range_count);
+		std::deque<std::uint64_t> pending;
+		for (std::uint64_t i = 0; i < range_count; i++)
+			pending.push_back(i);
+
+		socket_handle listener = listen_tcp(host, port);
+
+		// Launch the local worker processes. If the coordinator listens on
+		// all interfaces, they connect through the loopback interface.
+		const std::string connect_address = (host.empty() || host == "0.0.0.0" || host == "::" ? std::string("127.0.0.1") : host)
+			+ ":" + std::to_string(local_port(listener.get()));
+		std::vector<pid_t> helper_pids;
+		std::vector<bool> helper_reaped(process_count, false);
+		helper_pids.reserve(process_count);
 		for (std::size_t i = 0; i < process_count; i++)
-			n_done.wait();
+			helper_pids.push_back(spawn_helper(options, i, {"--connect=" + connect_address}));
 
-		// Write the list of prime numbers to standard output.
-		for (std::size_t i = 0; i < process_count; i++) {
-			const shm_vector<bool>& prime_table = prime_tables[i];
-			for (std::size_t j = 0; j < prime_table.size(); j++) {
-				if (prime_table[j]) {
-					std::cout << (range_offsets[i] + j) << std::endl;
-					if (--prime_count == 0)
-						goto exit;
+		std::vector<connection> connections;
+		std::uint64_t next_range = 0;
+
+		// Drops connection i, and puts the ranges leased to it back at the
+		// front of the queue.
+		const auto drop = [&](std::size_t i) {
+			std::vector<std::uint64_t>& leases = connections[i].leases;
+			pending.insert(pending.begin(), leases.begin(), leases.end());
+			connections.erase(connections.begin() + i);
+		};
+
+		while (next_range < range_count) {
+			// Print the ranges that are done, in order.
+			bool finished = false;
+			while (next_range < range_count && ranges[next_range].done) {
+				finished = print_primes(ranges[next_range].bitmap.data(), next_range * chunk_size, range_size(next_range, max_prime, chunk_size), prime_count);
+				std::vector<unsigned char>().swap(ranges[next_range].bitmap);
+				next_range++;
+				if (finished)
+					break;
+			}
+			if (finished || next_range == range_count)
+				break;
+
+			// Fail if no helper is left to test the remaining ranges.
+			std::size_t live_helper_count = 0;
+			for (std::size_t i = 0; i < process_count; i++) {
+				int exit_status;
+				if (!helper_reaped[i] && try_wait_process(helper_pids[i], exit_status))
+					helper_reaped[i] = true;
+				if (!helper_reaped[i])
+					live_helper_count++;
+			}
+			if (live_helper_count == 0 && connections.empty())
+				throw std::runtime_error(PACKAGE_NAME "-helper");
+
+			// Grant leases to helpers that have room for more.
+			for (std::size_t i = connections.size(); i-- > 0; ) {
+				connection& c = connections[i];
+				try {
+					while (c.ready && c.leases.size() < kLeasesPerWorker && !pending.empty()) {
+						const std::uint64_t range_id = pending.front();
+						pending.pop_front();
+						c.leases.push_back(range_id);
+						send_lease(c.socket.get(), lease_message{range_id, range_id * chunk_size, range_size(range_id, max_prime, chunk_size)});
+					}
+				}
+				catch (const std::exception&) {
+					drop(i);
+				}
+			}
+
+			std::vector<pollfd> fds;
+			fds.push_back(pollfd{listener.get(), POLLIN, 0});
+			for (const connection& c : connections)
+				fds.push_back(pollfd{c.socket.get(), POLLIN, 0});
+			if (poll(fds.data(), fds.size(), kHelperPollInterval) == -1) {
+				if (errno == EINTR)
+					continue;
+				throw std::system_error(errno, std::generic_category(), "poll");
+			}
+
+			// Read results. A helper that disconnects or breaks the protocol
+			// is dropped.
+			for (std::size_t i = connections.size(); i-- > 0; ) {
+				if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+					continue;
+				connection& c = connections[i];
+				try {
+					unsigned char buffer[65536];
+					const ssize_t n = recv(c.socket.get(), buffer, sizeof(buffer), 0);
+					if (n == -1 && errno == EINTR)
+						continue;
+					if (n <= 0)
+						throw std::runtime_error("connection closed");
+					c.reader.append(buffer, n);
+
+					frame f;
+					while (c.reader.next(f)) {
+						if (!c.ready) {
+							if (!is_valid_hello(f))
+								throw std::runtime_error("invalid hello frame");
+							c.ready = true;
+							continue;
+						}
+						if (f.type != message_type::result || f.payload.size() < 8)
+							throw std::runtime_error("unexpected frame");
+						const std::uint64_t range_id = get_uint64(f.payload.data());
+						const auto lease = std::find(c.leases.begin(), c.leases.end(), range_id);
+						if (lease == c.leases.end() || f.payload.size() - 8 != bitmap_size(range_size(range_id, max_prime, chunk_size)))
+							throw std::runtime_error("invalid result frame");
+						c.leases.erase(lease);
+						ranges[range_id].bitmap.assign(f.payload.begin() + 8, f.payload.end());
+						ranges[range_id].done = true;
+					}
+				}
+				catch (const std::exception&) {
+					drop(i);
+				}
+			}
+
+			// Accept a new helper.
+			if (fds[0].revents & POLLIN) {
+				socket_handle socket(accept(listener.get(), nullptr, nullptr));
+				if (socket.get() != -1) {
+					const int on = 1;
+					setsockopt(socket.get(), IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+					connections.push_back(connection{std::move(socket), frame_reader(), false, std::vector<std::uint64_t>()});
 				}
 			}
 		}
 
-	exit:
-		// Destroy shared memory objects.
-		segment.destroy_ptr(prime_tables);
+		// Tell the helpers to exit, and reap the local ones. Connections and
+		// the listener stay open until every local helper has exited, so that
+		// a helper that is still connecting or sending a result is told to
+		// exit too instead of having its connection reset. Exit statuses do
+		// not matter any more, since every prime has been printed.
+		for (const connection& c : connections) {
+			try {
+				send_done(c.socket.get());
+			}
+			catch (const std::exception&) {
+			}
+		}
+		for (;;) {
+			bool helpers_running = false;
+			for (std::size_t i = 0; i < process_count; i++) {
+				int exit_status;
+				if (!helper_reaped[i] && try_wait_process(helper_pids[i], exit_status))
+					helper_reaped[i] = true;
+				if (!helper_reaped[i])
+					helpers_running = true;
+			}
+			if (!helpers_running)
+				break;
+			pollfd fd = {listener.get(), POLLIN, 0};
+			if (poll(&fd, 1, kHelperShutdownPollInterval) > 0) {
+				socket_handle socket(accept(listener.get(), nullptr, nullptr));
+				if (socket.get() != -1) {
+					try {
+						send_done(socket.get());
+					}
+					catch (const std::exception&) {
+					}
+					connections.push_back(connection{std::move(socket), frame_reader(), false, std::vector<std::uint64_t>()});
+				}
+			}
+		}
 	}
 	catch (const std::exception& exception) {
 		std::cerr << PACKAGE_NAME << ": error: " << exception.what()
@@ -169,19 +1201,440 @@ int main(int argc, char* argv[]) {
 	return 0;
 }
 
-template<class CharT, class Traits>
-void show_usage(std::basic_ostream<CharT, Traits>& out) {
-	out << "Usage: " << PACKAGE_NAME << " <number of primes> <number of processes>\n"
-	    << "Write the first <number of primes> prime numbers to standard output using an\n"
-	    << "algorithm that executes <number of processes> tasks in parallel.\n\n"
-	    << "If the specified number of processes is 0, the program uses " << CPU_COUNT << " by default.\n"
-	    << "Prime numbers are separated by newlines."
-	    << std::endl;
+// Set by SIGINT and SIGTERM to make the daemon exit.
+volatile std::sig_atomic_t daemon_stop_requested = 0;
+
+void request_daemon_stop(int) {
+	daemon_stop_requested = 1;
+}
+
+// Parses text, which must consist of decimal digits only, into value.
+// Returns false if it does not or if the number is too large.
+bool parse_uint64(const std::string& text, std::uint64_t& value) {
+	if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos)
+		return false;
+	errno = 0;
+	const std::uintmax_t parsed = std::strtoumax(text.c_str(), nullptr, 10);
+	if (errno == ERANGE || parsed > UINT64_MAX)
+		return false;
+	value = parsed;
+	return true;
+}
+
+// Answers a query line from a client of the daemon on the socket fd, using
+// table and the read-only descriptor table_fd of the shared memory object
+// that holds it.
+void answer_query(int fd, const prime_table_view& table, int table_fd, const std::string& query) {
+	std::vector<std::string> words;
+	for (std::string::size_type begin = query.find_first_not_of(" \t\r"); begin != std::string::npos; ) {
+		const std::string::size_type end = query.find_first_of(" \t\r", begin);
+		words.push_back(query.substr(begin, end - begin));
+		begin = query.find_first_not_of(" \t\r", end);
+	}
+
+	std::uint64_t a = 0, b = 0;
+	const auto has_arguments = [&](std::size_t count) {
+		return words.size() == count + 1
+			&& (count < 1 || parse_uint64(words[1], a))
+			&& (count < 2 || parse_uint64(words[2], b));
+	};
+
+	std::string values;
+	std::uint64_t value_count = 0;
+	const auto add_value = [&](std::uint64_t value) {
+		values += std::to_string(value);
+		values += '\n';
+		value_count++;
+	};
+
+	const std::string command = words.empty() ? std::string() : words[0];
+	const char* error = nullptr;
+	if (command == "is-prime" && has_arguments(1)) {
+		if (a >= table.limit())
+			error = "out of range";
+		else
+			add_value(table.is_prime(a));
+	}
+	else if ((command == "count" || command == "range") && has_arguments(2)) {
+		if (a > b || b > table.limit())
+			error = "out of range";
+		else if (command == "count")
+			add_value(table.rank(b) - table.rank(a));
+		else if (table.rank(b) - table.rank(a) > kMaxQueryResults)
+			error = "too many results";
+		else {
+			for (std::uint64_t n = table.next_prime(a); n < b; n = table.next_prime(n + 1))
+				add_value(n);
+		}
+	}
+	else if (command == "first" && has_arguments(1)) {
+		if (a > table.prime_count())
+			error = "out of range";
+		else if (a > kMaxQueryResults)
+			error = "too many results";
+		else if (a > 0) {
+			const std::uint64_t last = table.select(a - 1);
+			for (std::uint64_t n = table.next_prime(0); n <= last; n = table.next_prime(n + 1))
+				add_value(n);
+		}
+	}
+	else if (command == "map" && has_arguments(0)) {
+		add_value(table.limit());
+		add_value(table.prime_count());
+	}
+	else {
+		error = "invalid query";
+	}
+
+	if (error) {
+		const std::string response = std::string("error ") + error + "\n";
+		send_all(fd, response.data(), response.size());
+		return;
+	}
+	const std::string response = "ok " + std::to_string(value_count) + "\n" + values;
+	if (command == "map")
+		send_with_fd(fd, response.data(), response.size(), table_fd);
+	else
+		send_all(fd, response.data(), response.size());
+}
+
+// Runs the driver as a daemon that listens at socket_path. The primes in
+// [0, max_prime) are found as usual and stored in a prime table in shared
+// memory (or with --table-file, in a file), which stays resident while the
+// daemon answers queries about it.
+// Clients connected while the table is built are answered once it is done.
+// The daemon exits on SIGINT or SIGTERM.
+int run_daemon(const char* socket_path, const run_options& options) {
+	struct client {
+		socket_handle socket;
+		std::string input;
+	};
+
+	// Removes the socket file and closes the table on exit.
+	struct daemon_resources {
+		const char* socket_path;
+		int table_fd;
+
+		~daemon_resources() {
+			if (table_fd != -1)
+				close(table_fd);
+			unlink(socket_path);
+		}
+	};
+
+	try {
+		socket_handle listener = listen_unix(socket_path);
+		daemon_resources resources = {socket_path, -1};
+
+		// With --table-file, a complete table left in the file by an earlier
+		// run is served again if it covers [0, options.max_prime).
+		std::unique_ptr<shared_segment> table;
+		if (!options.table_path.empty()) {
+			try {
+				shared_segment file = shared_segment::open_file(options.table_path);
+				if (prime_table_view(file.data(), file.size()).limit() >= options.max_prime)
+					table.reset(new shared_segment(std::move(file)));
+			}
+			catch (const std::runtime_error&) {
+			}
+		}
+
+		// Otherwise, build the table. In shared memory, the driver stores the
+		// bitmap of each range in it; in a file, which is sparse until then
+		// and may be larger than memory, the worker processes do.
+		if (!table) {
+			prime_table_header layout;
+			if (options.table_path.empty()) {
+				plan_prime_table(layout, options.max_prime, options.use_huge_pages ? huge_page_size() : kAlignment);
+				table.reset(new shared_segment(shared_segment::create(table_name(run_id), layout.table_size, options.use_huge_pages)));
+				*table->at<prime_table_header>(0) = layout;
+				std::atomic<std::uint64_t>* words = table->at<std::atomic<std::uint64_t>>(layout.bitmap_offset);
+				run_workers(options, kResultBitmap, [words](const result_header& result, const unsigned char* bitmap) {
+					store_range(words, bitmap, result.offset, result.size);
+					return false;
+				});
+			}
+			else {
+				plan_prime_table(layout, options.max_prime);
+				table.reset(new shared_segment(shared_segment::create_file(options.table_path, layout.table_size)));
+				*table->at<prime_table_header>(0) = layout;
+				run_workers(options, kResultTable, [](const result_header&, const unsigned char*) {
+					return false;
+				});
+			}
+			table->advise(MADV_SEQUENTIAL);
+			build_rank_index(table->data());
+			table->advise(MADV_NORMAL);
+		}
+		const prime_table_view view(table->data(), table->size());
+
+		// Clients map the table through a read-only descriptor passed over
+		// the socket, so its name can be removed right away, along with
+		// that of the worker processes' segment. A table file is kept.
+		if (options.table_path.empty())
+			resources.table_fd = shared_segment::open_descriptor(table_name(run_id), O_RDONLY);
+		else
+			resources.table_fd = open(options.table_path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (resources.table_fd == -1)
+			throw std::system_error(errno, std::generic_category(), options.table_path.empty() ? "shm_open" : "open " + options.table_path);
+		clean_up();
+
+#if !defined(NDEBUG) && defined(VERBOSE)
+		std::cerr << "Serving " << view.prime_count() << " primes below "
+		          << view.limit() << " at " << socket_path << "." << std::endl;
+#endif
+
+		struct sigaction action = {};
+		action.sa_handler = request_daemon_stop;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGINT, &action, nullptr);
+		sigaction(SIGTERM, &action, nullptr);
+
+		std::vector<client> clients;
+		while (!daemon_stop_requested) {
+			std::vector<pollfd> fds;
+			fds.push_back(pollfd{listener.get(), POLLIN, 0});
+			for (const client& c : clients)
+				fds.push_back(pollfd{c.socket.get(), POLLIN, 0});
+			if (poll(fds.data(), fds.size(), -1) == -1) {
+				if (errno == EINTR)
+					continue;
+				throw std::system_error(errno, std::generic_category(), "poll");
+			}
+
+			// Answer every complete query line. A client that disconnects or
+			// sends an overlong line is dropped.
+			for (std::size_t i = clients.size(); i-- > 0; ) {
+				if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+					continue;
+				client& c = clients[i];
+				try {
+					char buffer[kMaxQueryLength];
+					const ssize_t n = recv(c.socket.get(), buffer, sizeof(buffer), 0);
+					if (n == -1 && errno == EINTR)
+						continue;
+					if (n <= 0)
+						throw std::runtime_error("connection closed");
+					c.input.append(buffer, n);
+
+					std::string::size_type end;
+					while ((end = c.input.find('\n')) != std::string::npos) {
+						const std::string query = c.input.substr(0, end);
+						c.input.erase(0, end + 1);
+						answer_query(c.socket.get(), view, resources.table_fd, query);
+					}
+					if (c.input.size() > kMaxQueryLength)
+						throw std::runtime_error("query too long");
+				}
+				catch (const std::exception&) {
+					clients.erase(clients.begin() + i);
+				}
+			}
+
+			if (fds[0].revents & POLLIN) {
+				socket_handle socket(accept(listener.get(), nullptr, nullptr));
+				if (socket.get() != -1)
+					clients.push_back(client{std::move(socket), std::string()});
+			}
+		}
+	}
+	catch (const std::exception& exception) {
+		std::cerr << PACKAGE_NAME << ": error: " << exception.what()
+		          << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+// Sends the query made of the positional arguments to the daemon listening
+// at socket_path, and writes the values in its answer to standard output.
+// The table passed with the answer to a 'map' query is mapped and checked,
+// and its limit and prime count are written instead.
+int run_query(const char* socket_path, int argc, char* argv[]) {
+	if (argc < 2) {
+		show_usage(std::cerr);
+		return 1;
+	}
+	std::string query = argv[1];
+	for (int i = 2; i < argc; i++)
+		query.append(" ").append(argv[i]);
+	query += '\n';
+
+	int table_fd = -1;
+	try {
+		socket_handle socket = connect_unix(socket_path);
+		send_all(socket.get(), query.data(), query.size());
+
+		// Read the status line, then as many lines as it announces.
+		std::string response;
+		std::string::size_type status_end = std::string::npos, scanned = 0;
+		std::uint64_t line_count = 0, expected_line_count = 0;
+		for (;;) {
+			if (status_end == std::string::npos && (status_end = response.find('\n')) != std::string::npos) {
+				const std::string status = response.substr(0, status_end);
+				if (status.compare(0, 6, "error ") == 0) {
+					std::cerr << PACKAGE_NAME << ": " << status.substr(6) << std::endl;
+					if (table_fd != -1)
+						close(table_fd);
+					return 1;
+				}
+				if (status.compare(0, 3, "ok ") != 0 || !parse_uint64(status.substr(3), expected_line_count))
+					throw std::runtime_error("invalid response");
+				scanned = status_end + 1;
+			}
+			if (status_end != std::string::npos) {
+				for (; scanned < response.size(); scanned++) {
+					if (response[scanned] == '\n')
+						line_count++;
+				}
+				if (line_count >= expected_line_count)
+					break;
+			}
+
+			char buffer[65536];
+			const std::size_t n = receive_with_fd(socket.get(), buffer, sizeof(buffer), table_fd);
+			if (n == 0)
+				throw std::runtime_error("connection closed");
+			response.append(buffer, n);
+		}
+
+		if (table_fd == -1) {
+			std::cout << response.substr(status_end + 1) << std::flush;
+			return 0;
+		}
+
+		struct stat status;
+		if (fstat(table_fd, &status) == -1)
+			throw std::system_error(errno, std::generic_category(), "fstat");
+		void* data = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, table_fd, 0);
+		if (data == MAP_FAILED)
+			throw std::system_error(errno, std::generic_category(), "mmap");
+		close(table_fd);
+		table_fd = -1;
+		try {
+			const prime_table_view table(data, status.st_size);
+			std::cout << table.limit() << '\n' << table.prime_count() << std::endl;
+		}
+		catch (...) {
+			munmap(data, status.st_size);
+			throw;
+		}
+		munmap(data, status.st_size);
+	}
+	catch (const std::exception& exception) {
+		if (table_fd != -1)
+			close(table_fd);
+		std::cerr << PACKAGE_NAME << ": error: " << exception.what()
+		          << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+// Finds the primes in [0, max_prime) like run_workers(), but has the worker
+// processes publish only a reduce_record of each range, and writes the
+// aggregate named reduction ("count", "sum" or "maxgap") of all of them to
+// standard output.
+int run_reduction(const std::string& reduction, std::intmax_t prime_count, run_options options) {
+	// The nth prime is greater than n (ln n + ln ln n - 1) for n >= 2
+	// (Dusart), so only the ranges that end above that bound may hold the
+	// last prime wanted.
+	options.reduce_bitmap_from = 0;
+	if (prime_count >= 2) {
+		const double lower_bound = prime_count * (std::log(prime_count) + std::log(std::log(prime_count)) - 1);
+		if (lower_bound > 0)
+			options.reduce_bitmap_from = static_cast<std::uint64_t>(lower_bound);
+	}
+
+	try {
+		// Merge the records of whole ranges as long as they hold no more
+		// primes than are wanted, and reduce the part of the next range up
+		// to the last prime wanted from its bitmap.
+		reduce_record total = {0, 0, 0, kNoPrime, kNoPrime, 0, 0};
+		run_workers(options, kResultReduce, [&total, &prime_count](const result_header& result, const unsigned char* data) {
+			const reduce_record& record = *reinterpret_cast<const reduce_record*>(data);
+			if (record.prime_count <= static_cast<std::uintmax_t>(prime_count)) {
+				merge_records(total, record);
+				prime_count -= record.prime_count;
+				return prime_count == 0;
+			}
+			reduce_record prefix;
+			reduce_primes(data + sizeof(reduce_record), result.offset, result.size, prefix, prime_count);
+			merge_records(total, prefix);
+			prime_count = 0;
+			return true;
+		});
+
+		if (reduction == "count")
+			std::cout << total.prime_count << std::endl;
+		else if (reduction == "sum")
+			std::cout << decimal_string(total.sum_high, total.sum_low) << std::endl;
+		else if (total.max_gap != 0)
+			std::cout << total.max_gap << ' ' << total.max_gap_start << ' '
+			          << (total.max_gap_start + total.max_gap) << std::endl;
+		else
+			std::cout << 0 << std::endl;
+	}
+	catch (const std::exception& exception) {
+		std::cerr << PACKAGE_NAME << ": error: " << exception.what()
+		          << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+// Adds the reduce_record next of a range to total, the record of the ranges
+// before it. The gap between the last prime of total and the first prime of
+// next spans the boundary, so it is in neither record.
+void merge_records(reduce_record& total, const reduce_record& next) {
+	if (next.prime_count == 0)
+		return;
+	if (total.prime_count == 0) {
+		total = next;
+		return;
+	}
+	total.prime_count += next.prime_count;
+	total.sum_low += next.sum_low;
+	total.sum_high += next.sum_high + (total.sum_low < next.sum_low);
+	if (next.first_prime - total.last_prime > total.max_gap) {
+		total.max_gap = next.first_prime - total.last_prime;
+		total.max_gap_start = total.last_prime;
+	}
+	if (next.max_gap > total.max_gap) {
+		total.max_gap = next.max_gap;
+		total.max_gap_start = next.max_gap_start;
+	}
+	total.last_prime = next.last_prime;
 }
 
-// Deletes semaphore and shared memory segment (these resources are not
-// automatically released when the process exits otherwise).
+// Returns the decimal digits of the 128-bit integer whose upper and lower 64
+// bits are high and low.
+std::string decimal_string(std::uint64_t high, std::uint64_t low) {
+	// Divide by 10 repeatedly, 32 bits at a time from the top.
+	std::uint32_t limbs[4] = {static_cast<std::uint32_t>(high >> 32), static_cast<std::uint32_t>(high), static_cast<std::uint32_t>(low >> 32), static_cast<std::uint32_t>(low)};
+	std::string digits;
+	do {
+		std::uint64_t remainder = 0;
+		for (std::uint32_t& limb : limbs) {
+			const std::uint64_t value = (remainder << 32) | limb;
+			limb = static_cast<std::uint32_t>(value / 10);
+			remainder = value % 10;
+		}
+		digits.push_back(static_cast<char>('0' + remainder));
+	} while (limbs[0] | limbs[1] | limbs[2] | limbs[3]);
+	return std::string(digits.rbegin(), digits.rend());
+}
+
+// Deletes the shared memory segments of this run (these
+// resources are not automatically released when the process exits
+// otherwise). Those of other runs are left alone.
 void clean_up() {
-	boost::interprocess::named_semaphore::remove(kSemaphoreName);
-	boost::interprocess::shared_memory_object::remove(kSharedMemorySegmentName);
+	if (run_id.empty())
+		return;
+	shared_segment::remove(segment_name(run_id));
+	shared_segment::remove(table_name(run_id));
 }
+
@@ -0,0 +1,134 @@
+/**
+ * @file		partition.hpp
+ * An internal header. Divides the integers to be tested into ranges that
+ * take about the same time to test, rather than into ranges of the same
+ * size.
+ *
+ * Testing an integer n that is coprime to 2, 3 and 5 (the others are skipped
+ * by the wheel) is modeled to cost fixed + per_log_squared * ln²(n): the
+ * trial divisions and modular exponentiations take longer as n grows. The
+ * cost of a range is the integral of that cost over the range, so ranges of
+ * large integers are narrower than ranges of small ones. The coefficients
+ * can be measured on the host with 'distributed-prime-numbers-helper
+ * --calibrate'.
+ *
+ * @author		Jennifer Yao
+ * @date		2015
+ * @copyright	All rights reserved.
+ */
+
+#ifndef PARTITION_HPP
+#define PARTITION_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// The fraction of integers that are coprime to 2, 3 and 5.
+#define kWheelDensity (8.0 / 30.0)
+
+// The default cost model, in nanoseconds per integer coprime to 2, 3 and 5.
+#define kDefaultFixedCost 4000.0
+#define kDefaultLogSquaredCost 20.0
+
+/**
+ * The modeled cost of testing an integer n that is coprime to 2, 3 and 5:
+ * fixed + per_log_squared * ln²(n).
+ */
+struct cost_model {
+	double fixed;
+	double per_log_squared;
+};
+
+/**
+ * A measured cost of testing the integers coprime to 2, 3 and 5 around n.
+ */
+struct cost_sample {
+	double n;
+	double cost;
+};
+
+inline cost_model default_cost_model() noexcept {
+	return cost_model{kDefaultFixedCost, kDefaultLogSquaredCost};
+}
+
+/**
+ * Returns the modeled cost of testing the integers in [0, @p n).
+ */
+inline double cumulative_cost(const cost_model& model, double n) noexcept {
+	if (n < 1)
+		return 0;
+	// The integral of ln²(x) from 1 to n.
+	const double l = std::log(n);
+	const double log_squared_integral = n * (l * l - 2 * l + 2) - 2;
+	return kWheelDensity * (model.fixed * n + model.per_log_squared * log_squared_integral);
+}
+
+/**
+ * Divides the integers in [0, @p max_prime) into at most @p range_count
+ * ranges of about the same modeled cost, whose boundaries are multiples of
+ * @p alignment, and returns the boundaries: range i is [offsets[i],
+ * offsets[i + 1]). No range is empty.
+ * @pre @p max_prime != 0, @p range_count != 0 and @p alignment != 0.
+ */
+inline std::vector<std::uint64_t> plan_ranges(const cost_model& model, std::uint64_t max_prime, std::uint64_t range_count, std::uint64_t alignment) {
+	const double total = cumulative_cost(model, static_cast<double>(max_prime));
+	std::vector<std::uint64_t> offsets(1, 0);
+	for (std::uint64_t i = 1; i < range_count; i++) {
+		// Find the smallest multiple of alignment past the last boundary at
+		// which the cost reaches i / range_count of the total.
+		const double target = total * i / range_count;
+		std::uint64_t low = offsets.back() / alignment;
+		std::uint64_t high = (max_prime + alignment - 1) / alignment;
+		while (high - low > 1) {
+			const std::uint64_t middle = low + (high - low) / 2;
+			if (cumulative_cost(model, static_cast<double>(middle * alignment)) < target)
+				low = middle;
+			else
+				high = middle;
+		}
+		if (high * alignment >= max_prime)
+			break;
+		offsets.push_back(high * alignment);
+	}
+	offsets.push_back(max_prime);
+	return offsets;
+}
+
+/**
+ * Fits a cost model to @p samples by least squares. Neither coefficient is
+ * made negative; if the samples show no cost at all, returns the default
+ * model.
+ */
+inline cost_model fit_cost_model(const std::vector<cost_sample>& samples) {
+	if (samples.empty())
+		return default_cost_model();
+
+	// Fit cost = fixed + per_log_squared * x, where x = ln²(n).
+	double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+	for (const cost_sample& sample : samples) {
+		const double l = std::log(sample.n > 1 ? sample.n : 1);
+		const double x = l * l;
+		sum_x += x;
+		sum_y += sample.cost;
+		sum_xx += x * x;
+		sum_xy += x * sample.cost;
+	}
+	const double count = static_cast<double>(samples.size());
+	const double variance = count * sum_xx - sum_x * sum_x;
+	cost_model model{sum_y / count, 0};
+	if (variance > 0) {
+		model.per_log_squared = (count * sum_xy - sum_x * sum_y) / variance;
+		model.fixed = (sum_y - model.per_log_squared * sum_x) / count;
+	}
+	if (model.per_log_squared < 0)
+		model = cost_model{sum_y / count, 0};
+	else if (model.fixed < 0)
+		model = cost_model{0, sum_xx > 0 ? sum_xy / sum_xx : 0};
+	if (!(model.fixed > 0 || model.per_log_squared > 0))
+		return default_cost_model();
+	return model;
+}
+
+#endif // PARTITION_HPP
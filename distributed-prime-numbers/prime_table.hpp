@@ -0,0 +1,212 @@
+/**
+ * @file		prime_table.hpp
+ * An internal header. Defines the layout of the prime table that
+ * 'distributed-prime-numbers --serve' keeps resident in shared memory, and
+ * the queries that can be answered from it.
+ *
+ * The table is a header, followed by a bitmap of 64-bit words in which bit
+ * (n % 64) of word (n / 64) is set if n is prime, followed by a rank index
+ * that holds the number of primes below the start of every block of
+ * kTableBlockBits integers. Clients that map the table read-only can answer
+ * queries themselves with prime_table_view.
+ *
+ * The magic number is only written once the table is complete, so a table
+ * kept in a file by 'distributed-prime-numbers --table-file' can be reused
+ * by later runs, and one left incomplete by a run that died is never
+ * mistaken for a complete one.
+ *
+ * @author		Jennifer Yao
+ * @date		2015
+ * @copyright	All rights reserved.
+ */
+
+#ifndef PRIME_TABLE_HPP
+#define PRIME_TABLE_HPP
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <bitset>
+#include <stdexcept>
+#include <string>
+
+#include "shared_memory.hpp"
+
+#define kTableMagic UINT64_C(0x3436303a7461626c)
+#define kTableVersion 1
+
+// The number of integers per entry of the rank index.
+#define kTableBlockBits 512
+#define kTableWordsPerBlock (kTableBlockBits / 64)
+
+inline std::string table_name(const std::string& run_id) {
+	return "/" + ipc_name(run_id, "prime-table");
+}
+
+/**
+ * The header at the start of a prime table.
+ */
+struct prime_table_header {
+	std::uint64_t magic;
+	std::uint64_t version;
+	std::uint64_t table_size;
+	// The table covers the integers in [0, limit).
+	std::uint64_t limit;
+	std::uint64_t prime_count;
+	std::uint64_t bitmap_offset;
+	std::uint64_t rank_index_offset;
+};
+
+/**
+ * Fills in the sizes and offsets of @p header for a table of the integers in
+ * [0, @p limit), whose size is a multiple of @p page_size. The magic number
+ * is left 0 until build_rank_index().
+ * @pre @p page_size is a power of two, and at least kAlignment.
+ */
+inline void plan_prime_table(prime_table_header& header, std::uint64_t limit, std::size_t page_size = kAlignment) {
+	const std::uint64_t block_count = limit / kTableBlockBits + 1;
+	header = prime_table_header();
+	header.version = kTableVersion;
+	header.limit = limit;
+	header.bitmap_offset = align<kCacheLineSize>(sizeof(prime_table_header));
+	header.rank_index_offset = align<kCacheLineSize>(header.bitmap_offset + block_count * kTableWordsPerBlock * sizeof(std::uint64_t));
+	header.table_size = align_to(header.rank_index_offset + block_count * sizeof(std::uint64_t), page_size);
+}
+
+inline unsigned popcount(std::uint64_t word) noexcept {
+	return static_cast<unsigned>(std::bitset<64>(word).count());
+}
+
+/**
+ * A read-only view of a prime table that has been mapped into memory.
+ */
+class prime_table_view {
+public:
+	/**
+	 * @throws std::runtime_error if @p size bytes at @p data do not hold a
+	 *         prime table.
+	 */
+	prime_table_view(const void* data, std::size_t size) : header_(static_cast<const prime_table_header*>(data)), words_(nullptr), ranks_(nullptr) {
+		if (size < sizeof(prime_table_header) || header_->magic != kTableMagic || header_->version != kTableVersion || header_->table_size > size)
+			throw std::runtime_error("invalid prime table");
+		words_ = reinterpret_cast<const std::uint64_t*>(static_cast<const char*>(data) + header_->bitmap_offset);
+		ranks_ = reinterpret_cast<const std::uint64_t*>(static_cast<const char*>(data) + header_->rank_index_offset);
+	}
+
+	std::uint64_t limit() const noexcept {
+		return header_->limit;
+	}
+
+	// The number of primes in the table.
+	std::uint64_t prime_count() const noexcept {
+		return header_->prime_count;
+	}
+
+	// n must be less than limit().
+	bool is_prime(std::uint64_t n) const noexcept {
+		return (words_[n / 64] >> (n % 64)) & 1;
+	}
+
+	// Returns the number of primes less than n, where n <= limit().
+	std::uint64_t rank(std::uint64_t n) const noexcept {
+		std::uint64_t count = ranks_[n / kTableBlockBits];
+		for (std::uint64_t i = n / kTableBlockBits * kTableWordsPerBlock; i < n / 64; i++)
+			count += popcount(words_[i]);
+		if (n % 64 != 0)
+			count += popcount(words_[n / 64] & ((UINT64_C(1) << (n % 64)) - 1));
+		return count;
+	}
+
+	// Returns the smallest prime that is at least n, or limit() if there is
+	// none in the table.
+	std::uint64_t next_prime(std::uint64_t n) const noexcept {
+		if (n >= header_->limit)
+			return header_->limit;
+		std::uint64_t i = n / 64;
+		std::uint64_t word = words_[i] & (~UINT64_C(0) << (n % 64));
+		const std::uint64_t word_count = (header_->limit + 63) / 64;
+		while (word == 0) {
+			if (++i == word_count)
+				return header_->limit;
+			word = words_[i];
+		}
+		unsigned bit = 0;
+		while (!((word >> bit) & 1))
+			bit++;
+		return i * 64 + bit;
+	}
+
+	// Returns the kth prime (counting from 0), where k < prime_count().
+	std::uint64_t select(std::uint64_t k) const noexcept {
+		// Find the last block with fewer than k + 1 primes before it, then
+		// the word within it.
+		std::uint64_t low = 0, high = header_->limit / kTableBlockBits + 1;
+		while (high - low > 1) {
+			const std::uint64_t middle = low + (high - low) / 2;
+			if (ranks_[middle] <= k)
+				low = middle;
+			else
+				high = middle;
+		}
+		k -= ranks_[low];
+		std::uint64_t i = low * kTableWordsPerBlock;
+		for (unsigned count; k >= (count = popcount(words_[i])); i++)
+			k -= count;
+		std::uint64_t n = i * 64;
+		for (std::uint64_t word = words_[i]; ; word >>= 1, n++) {
+			if ((word & 1) && k-- == 0)
+				return n;
+		}
+	}
+
+private:
+	const prime_table_header* header_;
+	const std::uint64_t* words_;
+	const std::uint64_t* ranks_;
+};
+
+static_assert(sizeof(std::atomic<std::uint64_t>) == sizeof(std::uint64_t), "The words of the table bitmap are read as plain 64-bit words.");
+
+/**
+ * Sets the bits of the table bitmap @p words for the integers in
+ * [offset, offset + size) from the packed bitmap of a range, in which bit i
+ * is set if offset + i is prime. @p offset must be a multiple of CHAR_BIT.
+ * The bits are set with one atomic OR per word, so a range may be stored by
+ * a worker and its backup at the same time, and ranges may share words.
+ */
+inline void store_range(std::atomic<std::uint64_t>* words, const unsigned char* bitmap, std::uint64_t offset, std::uint64_t size) noexcept {
+	std::uint64_t word = 0;
+	for (std::uint64_t i = 0; i < bitmap_size(size); i++) {
+		const std::uint64_t n = offset + i * CHAR_BIT;
+		word |= static_cast<std::uint64_t>(bitmap[i]) << (n % 64);
+		if ((n + CHAR_BIT) % 64 == 0 || i + 1 == bitmap_size(size)) {
+			if (word != 0)
+				words[n / 64].fetch_or(word, std::memory_order_relaxed);
+			word = 0;
+		}
+	}
+}
+
+/**
+ * Fills in the rank index and prime count of the table at @p data, whose
+ * bitmap is complete, in a single pass over the bitmap, and then marks the
+ * table complete by writing its magic number.
+ */
+inline void build_rank_index(void* data) noexcept {
+	prime_table_header& header = *static_cast<prime_table_header*>(data);
+	const std::uint64_t* words = reinterpret_cast<const std::uint64_t*>(static_cast<char*>(data) + header.bitmap_offset);
+	std::uint64_t* ranks = reinterpret_cast<std::uint64_t*>(static_cast<char*>(data) + header.rank_index_offset);
+	const std::uint64_t block_count = header.limit / kTableBlockBits + 1;
+	std::uint64_t count = 0;
+	for (std::uint64_t i = 0; i < block_count; i++) {
+		ranks[i] = count;
+		for (std::uint64_t j = 0; j < kTableWordsPerBlock; j++)
+			count += popcount(words[i * kTableWordsPerBlock + j]);
+	}
+	header.prime_count = count;
+	std::atomic_thread_fence(std::memory_order_release);
+	header.magic = kTableMagic;
+}
+
+#endif // PRIME_TABLE_HPP
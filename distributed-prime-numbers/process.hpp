@@ -0,0 +1,119 @@
+/**
+ * @file		process.hpp
+ * An internal header. Launches and reaps child processes without going
+ * through a shell.
+ *
+ * @author		Jennifer Yao
+ * @date		2015
+ * @copyright	All rights reserved.
+ */
+
+#ifndef PROCESS_HPP
+#define PROCESS_HPP
+
+#include <cerrno>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <signal.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#if defined(CLONE_PARENT) && defined(SYS_clone)
+#define HAVE_FORK_SIBLING 1
+#endif
+#endif
+
+extern char** environ;
+
+/**
+ * Starts @p args[0] with the argument vector @p args and returns the process
+ * ID of the new child process. The program is executed directly, not through
+ * a shell, so the arguments need no quoting. The call does not wait for the
+ * child process to finish. Unless they are -1, @p stdin_fd and @p stdout_fd
+ * become the standard input and output of the child process.
+ * @throws std::system_error if the process could not be started.
+ */
+inline pid_t spawn_process(const std::vector<std::string>& args, int stdin_fd = -1, int stdout_fd = -1) {
+	std::vector<char*> argv;
+	argv.reserve(args.size() + 1);
+	for (const std::string& arg : args)
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	argv.push_back(nullptr);
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	if (stdin_fd != -1)
+		posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
+	if (stdout_fd != -1)
+		posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+
+	pid_t pid;
+	const int error = posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (error != 0)
+		throw std::system_error(error, std::generic_category(), "posix_spawn " + args[0]);
+	return pid;
+}
+
+#if HAVE_FORK_SIBLING
+/**
+ * Forks the calling process like fork(), except that the new process is a
+ * child of the caller's parent rather than of the caller, so that the parent
+ * can wait for it. Returns 0 in the new process, and its process ID or -1 in
+ * the caller. Unlike fork(), it runs no atfork handlers, so the caller must
+ * be single-threaded.
+ */
+inline pid_t fork_sibling() noexcept {
+	return static_cast<pid_t>(syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, nullptr, nullptr, 0));
+}
+#endif
+
+/**
+ * Waits for the child process @p pid to terminate and returns its exit
+ * status, or -1 if it was killed by a signal.
+ * @throws std::system_error if waitpid() fails.
+ */
+inline int wait_process(pid_t pid) {
+	int status;
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR)
+			throw std::system_error(errno, std::generic_category(), "waitpid");
+	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * Checks, without blocking, whether the child process @p pid has terminated.
+ * If it has, stores its exit status (or -1 if it was killed by a signal) in
+ * @p exit_status and returns true.
+ * @throws std::system_error if waitpid() fails.
+ */
+inline bool try_wait_process(pid_t pid, int& exit_status) {
+	int status;
+	pid_t result;
+	while ((result = waitpid(pid, &status, WNOHANG)) == -1) {
+		if (errno != EINTR)
+			throw std::system_error(errno, std::generic_category(), "waitpid");
+	}
+	if (result == 0)
+		return false;
+	exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	return true;
+}
+
+/**
+ * Kills the child process @p pid with SIGKILL. The process must still be
+ * reaped with wait_process().
+ */
+inline void kill_process(pid_t pid) noexcept {
+	kill(pid, SIGKILL);
+}
+
+#endif // PROCESS_HPP
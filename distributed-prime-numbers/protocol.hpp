@@ -0,0 +1,220 @@
+/**
+ * @file		protocol.hpp
+ * An internal header. Defines the protocol through which a coordinating
+ * 'distributed-prime-numbers' and remote helpers communicate over TCP.
+ *
+ * Every message is sent as a frame: a 4-byte payload length, a 1-byte
+ * message type and the payload. All integers are unsigned and big-endian.
+ *
+ * - hello (helper to coordinator): magic, protocol version. Sent once after
+ *   connecting.
+ * - lease (coordinator to helper): range ID, offset, size. The helper tests
+ *   the range and answers with a result. A helper holds at most
+ *   kLeasesPerWorker leases at a time, so that it can start on the next range
+ *   while its last result is in flight.
+ * - result (helper to coordinator): range ID, followed by the packed bitmap
+ *   of the range (bit i is set if offset + i is prime).
+ * - done (coordinator to helper): no more leases will be granted; the helper
+ *   exits.
+ *
+ * If a helper disconnects, the ranges it holds leases on are granted to other
+ * helpers.
+ *
+ * @author		Jennifer Yao
+ * @date		2015
+ * @copyright	All rights reserved.
+ */
+
+#ifndef PROTOCOL_HPP
+#define PROTOCOL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "socket.hpp"
+
+#define kProtocolMagic UINT64_C(0x64706e2d74637031)
+#define kProtocolVersion 1
+
+// The size of a frame header: a 4-byte payload length and a message type.
+#define kFrameHeaderSize 5
+
+// The largest payload that a frame may carry (256 MiB, i.e. the bitmap of a
+// range of 2^31 integers).
+#define kMaxFramePayload (UINT32_C(1) << 28)
+
+// The number of leases that a helper may hold at a time.
+#define kLeasesPerWorker 2
+
+enum class message_type : std::uint8_t {
+	hello = 1,
+	lease = 2,
+	result = 3,
+	done = 4
+};
+
+/**
+ * A decoded frame.
+ */
+struct frame {
+	message_type type;
+	std::vector<unsigned char> payload;
+};
+
+/**
+ * A range of integers leased to a helper.
+ */
+struct lease_message {
+	std::uint64_t range_id;
+	std::uint64_t offset;
+	std::uint64_t size;
+};
+
+inline void put_uint64(std::vector<unsigned char>& out, std::uint64_t value) {
+	for (int shift = 56; shift >= 0; shift -= 8)
+		out.push_back(static_cast<unsigned char>(value >> shift));
+}
+
+inline std::uint64_t get_uint64(const unsigned char* in) noexcept {
+	std::uint64_t value = 0;
+	for (int i = 0; i < 8; i++)
+		value = (value << 8) | in[i];
+	return value;
+}
+
+/**
+ * Sends a frame of the given type with @p size bytes of payload at @p data
+ * to the socket @p fd.
+ * @throws std::system_error if the socket fails.
+ */
+inline void send_frame(int fd, message_type type, const void* data, std::size_t size) {
+	if (size > kMaxFramePayload)
+		throw std::length_error("frame payload too large");
+	const unsigned char header[kFrameHeaderSize] = {
+		static_cast<unsigned char>(size >> 24),
+		static_cast<unsigned char>(size >> 16),
+		static_cast<unsigned char>(size >> 8),
+		static_cast<unsigned char>(size),
+		static_cast<unsigned char>(type)
+	};
+	send_all(fd, header, sizeof(header));
+	send_all(fd, data, size);
+}
+
+inline void send_frame(int fd, message_type type, const std::vector<unsigned char>& payload) {
+	send_frame(fd, type, payload.data(), payload.size());
+}
+
+inline void send_hello(int fd) {
+	std::vector<unsigned char> payload;
+	put_uint64(payload, kProtocolMagic);
+	put_uint64(payload, kProtocolVersion);
+	send_frame(fd, message_type::hello, payload);
+}
+
+inline void send_lease(int fd, const lease_message& lease) {
+	std::vector<unsigned char> payload;
+	put_uint64(payload, lease.range_id);
+	put_uint64(payload, lease.offset);
+	put_uint64(payload, lease.size);
+	send_frame(fd, message_type::lease, payload);
+}
+
+inline void send_result(int fd, std::uint64_t range_id, const std::vector<unsigned char>& bitmap) {
+	std::vector<unsigned char> payload;
+	payload.reserve(8 + bitmap.size());
+	put_uint64(payload, range_id);
+	payload.insert(payload.end(), bitmap.begin(), bitmap.end());
+	send_frame(fd, message_type::result, payload);
+}
+
+inline void send_done(int fd) {
+	send_frame(fd, message_type::done, nullptr, 0);
+}
+
+/**
+ * Returns true if @p f is a hello frame for this version of the protocol.
+ */
+inline bool is_valid_hello(const frame& f) noexcept {
+	return f.type == message_type::hello && f.payload.size() == 16
+		&& get_uint64(&f.payload[0]) == kProtocolMagic
+		&& get_uint64(&f.payload[8]) == kProtocolVersion;
+}
+
+/**
+ * Decodes the lease frame @p f.
+ * @throws std::runtime_error if @p f is not a valid lease frame.
+ */
+inline lease_message decode_lease(const frame& f) {
+	if (f.type != message_type::lease || f.payload.size() != 24)
+		throw std::runtime_error("invalid lease frame");
+	return lease_message{get_uint64(&f.payload[0]), get_uint64(&f.payload[8]), get_uint64(&f.payload[16])};
+}
+
+/**
+ * Reassembles frames from bytes read from a socket in arbitrary pieces.
+ */
+class frame_reader {
+public:
+	frame_reader() : buffer_() {}
+
+	/**
+	 * Appends @p size bytes at @p data to the bytes received so far.
+	 */
+	void append(const void* data, std::size_t size) {
+		const unsigned char* p = static_cast<const unsigned char*>(data);
+		buffer_.insert(buffer_.end(), p, p + size);
+	}
+
+	/**
+	 * Removes the first complete frame from the bytes received so far and
+	 * stores it in @p f. Returns false if no complete frame has been
+	 * received yet.
+	 * @throws std::runtime_error if the frame is too large.
+	 */
+	bool next(frame& f) {
+		if (buffer_.size() < kFrameHeaderSize)
+			return false;
+		const std::size_t size = decode_size(buffer_.data());
+		if (size > kMaxFramePayload)
+			throw std::runtime_error("frame payload too large");
+		if (buffer_.size() < kFrameHeaderSize + size)
+			return false;
+		f.type = static_cast<message_type>(buffer_[4]);
+		f.payload.assign(buffer_.begin() + kFrameHeaderSize, buffer_.begin() + kFrameHeaderSize + size);
+		buffer_.erase(buffer_.begin(), buffer_.begin() + kFrameHeaderSize + size);
+		return true;
+	}
+
+	static std::size_t decode_size(const unsigned char* header) noexcept {
+		return (static_cast<std::size_t>(header[0]) << 24) | (static_cast<std::size_t>(header[1]) << 16)
+			| (static_cast<std::size_t>(header[2]) << 8) | header[3];
+	}
+
+private:
+	std::vector<unsigned char> buffer_;
+};
+
+/**
+ * Reads one whole frame from the socket @p fd into @p f. Returns false if the
+ * peer closed the connection between frames.
+ * @throws std::system_error if the socket fails, or std::runtime_error if the
+ *         frame is too large or truncated.
+ */
+inline bool receive_frame(int fd, frame& f) {
+	unsigned char header[kFrameHeaderSize];
+	if (!receive_all(fd, header, sizeof(header)))
+		return false;
+	const std::size_t size = frame_reader::decode_size(header);
+	if (size > kMaxFramePayload)
+		throw std::runtime_error("frame payload too large");
+	f.type = static_cast<message_type>(header[4]);
+	f.payload.resize(size);
+	if (size > 0 && !receive_all(fd, f.payload.data(), size))
+		throw std::runtime_error("connection closed in the middle of a frame");
+	return true;
+}
+
+#endif // PROTOCOL_HPP
@@ -0,0 +1,389 @@
+/**
+ * @file		ring_buffer.hpp
+ * An internal header. Bounded lock-free queues and deques that can be placed
+ * in memory shared between processes.
+ *
+ * @author		Jennifer Yao
+ * @date		2015
+ * @copyright	All rights reserved.
+ */
+
+#ifndef RING_BUFFER_HPP
+#define RING_BUFFER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <new>
+#include <type_traits>
+
+#include <sched.h>
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "std::atomic<std::uint64_t> must be lock-free to be shared between processes.");
+
+/**
+ * A bounded multi-producer/multi-consumer queue (Dmitry Vyukov's algorithm).
+ *
+ * The queue header and its cells live in one contiguous block of memory that
+ * contains no pointers, so it may be mapped at different addresses in
+ * different processes. Use required_size() to size the block, create() to
+ * construct the queue in it, and attach() to use an existing queue.
+ *
+ * @tparam T A trivially copyable element type.
+ */
+template<class T>
+class mpmc_ring {
+	static_assert(std::is_trivially_copyable<T>::value, "Elements must be trivially copyable.");
+
+public:
+	/**
+	 * Returns the number of bytes needed for a queue of the given capacity.
+	 * @pre @p capacity is a power of two.
+	 */
+	static constexpr std::size_t required_size(std::size_t capacity) noexcept {
+		return sizeof(mpmc_ring) + capacity * sizeof(cell);
+	}
+
+	/**
+	 * Constructs an empty queue of the given capacity in @p memory.
+	 * @pre @p memory points to at least required_size(@p capacity) bytes.
+	 * @pre @p capacity is a power of two.
+	 */
+	static mpmc_ring* create(void* memory, std::size_t capacity) {
+		mpmc_ring* ring = new (memory) mpmc_ring(capacity);
+		for (std::size_t i = 0; i < capacity; i++)
+			new (&ring->cells()[i]) cell(i);
+		return ring;
+	}
+
+	/**
+	 * Returns the queue previously constructed in @p memory by create().
+	 */
+	static mpmc_ring* attach(void* memory) noexcept {
+		return static_cast<mpmc_ring*>(memory);
+	}
+
+	std::size_t capacity() const noexcept {
+		return mask_ + 1;
+	}
+
+	/**
+	 * Appends @p value to the queue. Returns false if the queue is full.
+	 */
+	bool try_push(const T& value) noexcept {
+		std::uint64_t position = tail_.load(std::memory_order_relaxed);
+		cell* c;
+		for (;;) {
+			c = &cells()[position & mask_];
+			const std::uint64_t sequence = c->sequence.load(std::memory_order_acquire);
+			const std::int64_t difference = static_cast<std::int64_t>(sequence - position);
+			if (difference == 0) {
+				if (tail_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (difference < 0) {
+				return false;
+			}
+			else {
+				position = tail_.load(std::memory_order_relaxed);
+			}
+		}
+		c->value = value;
+		c->sequence.store(position + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * Removes the element at the front of the queue and stores it in
+	 * @p value. Returns false if the queue is empty.
+	 */
+	bool try_pop(T& value) noexcept {
+		std::uint64_t position = head_.load(std::memory_order_relaxed);
+		cell* c;
+		for (;;) {
+			c = &cells()[position & mask_];
+			const std::uint64_t sequence = c->sequence.load(std::memory_order_acquire);
+			const std::int64_t difference = static_cast<std::int64_t>(sequence - (position + 1));
+			if (difference == 0) {
+				if (head_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (difference < 0) {
+				return false;
+			}
+			else {
+				position = head_.load(std::memory_order_relaxed);
+			}
+		}
+		value = c->value;
+		c->sequence.store(position + mask_ + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * Like try_push(), but yields the processor and retries while the queue
+	 * is full.
+	 */
+	void push(const T& value) noexcept {
+		while (!try_push(value))
+			sched_yield();
+	}
+
+	/**
+	 * Like try_pop(), but yields the processor and retries while the queue
+	 * is empty.
+	 */
+	void pop(T& value) noexcept {
+		while (!try_pop(value))
+			sched_yield();
+	}
+
+private:
+	struct cell {
+		explicit cell(std::uint64_t sequence) noexcept : sequence(sequence), value() {}
+
+		std::atomic<std::uint64_t> sequence;
+		T value;
+	};
+
+	// The producer and consumer indices are kept on separate cache lines.
+	alignas(64) const std::uint64_t mask_;
+	alignas(64) std::atomic<std::uint64_t> head_;
+	alignas(64) std::atomic<std::uint64_t> tail_;
+
+	explicit mpmc_ring(std::size_t capacity) noexcept : mask_(capacity - 1), head_(0), tail_(0) {}
+
+	cell* cells() noexcept {
+		return reinterpret_cast<cell*>(this + 1);
+	}
+};
+
+/**
+ * A bounded single-producer/single-consumer queue of fixed-size byte slots.
+ *
+ * Like mpmc_ring, the queue lives in one contiguous block of memory that
+ * contains no pointers. Elements are written and read in place: the producer
+ * fills the slot returned by try_reserve() and publishes it with commit(),
+ * and the consumer reads the slot returned by front() and releases it with
+ * pop(). A reserved slot that is never committed is simply reused.
+ */
+class spsc_ring {
+public:
+	/**
+	 * Returns the number of bytes needed for a queue of @p capacity slots of
+	 * @p slot_size bytes each.
+	 */
+	static constexpr std::size_t required_size(std::size_t capacity, std::size_t slot_size) noexcept {
+		return sizeof(spsc_ring) + capacity * slot_size;
+	}
+
+	/**
+	 * Constructs an empty queue in @p memory.
+	 * @pre @p memory points to at least required_size(@p capacity,
+	 *      @p slot_size) bytes.
+	 */
+	static spsc_ring* create(void* memory, std::size_t capacity, std::size_t slot_size) {
+		return new (memory) spsc_ring(capacity, slot_size);
+	}
+
+	/**
+	 * Returns the queue previously constructed in @p memory by create().
+	 */
+	static spsc_ring* attach(void* memory) noexcept {
+		return static_cast<spsc_ring*>(memory);
+	}
+
+	std::size_t capacity() const noexcept {
+		return capacity_;
+	}
+
+	std::size_t slot_size() const noexcept {
+		return slot_size_;
+	}
+
+	/**
+	 * Returns the next free slot, or nullptr if the queue is full. Producer
+	 * only.
+	 */
+	void* try_reserve() noexcept {
+		const std::uint64_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail - head_.load(std::memory_order_acquire) == capacity_)
+			return nullptr;
+		return slot(tail);
+	}
+
+	/**
+	 * Publishes the slot returned by the last call to try_reserve(). Producer
+	 * only.
+	 */
+	void commit() noexcept {
+		tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	/**
+	 * Returns the oldest published slot, or nullptr if the queue is empty.
+	 * Consumer only.
+	 */
+	const void* front() noexcept {
+		const std::uint64_t head = head_.load(std::memory_order_relaxed);
+		if (head == tail_.load(std::memory_order_acquire))
+			return nullptr;
+		return slot(head);
+	}
+
+	/**
+	 * Releases the slot returned by front(). Consumer only.
+	 */
+	void pop() noexcept {
+		head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+private:
+	alignas(64) const std::uint64_t capacity_;
+	const std::uint64_t slot_size_;
+	alignas(64) std::atomic<std::uint64_t> head_;
+	alignas(64) std::atomic<std::uint64_t> tail_;
+
+	spsc_ring(std::size_t capacity, std::size_t slot_size) noexcept : capacity_(capacity), slot_size_(slot_size), head_(0), tail_(0) {}
+
+	unsigned char* slot(std::uint64_t index) noexcept {
+		return reinterpret_cast<unsigned char*>(this + 1) + (index % capacity_) * slot_size_;
+	}
+};
+
+/**
+ * A bounded work-stealing deque (the Chase-Lev deque, with the memory
+ * orderings of Le et al., "Correct and Efficient Work-Stealing for Weak
+ * Memory Models"). Its owner pushes and pops elements at the bottom; anyone
+ * else may steal the element at the top.
+ *
+ * Like mpmc_ring, the deque lives in one contiguous block of memory that
+ * contains no pointers. Elements are only ever taken from the top by a
+ * compare-and-swap of top, a 64-bit index that only grows and never wraps,
+ * so a thief with a stale index can never succeed (there is no ABA problem).
+ *
+ * @tparam T A trivially copyable element type.
+ */
+template<class T>
+class work_deque {
+	static_assert(std::is_trivially_copyable<T>::value, "Elements must be trivially copyable.");
+
+public:
+	/**
+	 * Returns the number of bytes needed for a deque of the given capacity.
+	 * @pre @p capacity is a power of two.
+	 */
+	static constexpr std::size_t required_size(std::size_t capacity) noexcept {
+		return sizeof(work_deque) + capacity * sizeof(std::atomic<T>);
+	}
+
+	/**
+	 * Constructs an empty deque of the given capacity in @p memory.
+	 * @pre @p memory points to at least required_size(@p capacity) bytes.
+	 * @pre @p capacity is a power of two.
+	 */
+	static work_deque* create(void* memory, std::size_t capacity) {
+		work_deque* deque = new (memory) work_deque(capacity);
+		for (std::size_t i = 0; i < capacity; i++)
+			new (&deque->cells()[i]) std::atomic<T>(T());
+		return deque;
+	}
+
+	/**
+	 * Returns the deque previously constructed in @p memory by create().
+	 */
+	static work_deque* attach(void* memory) noexcept {
+		return static_cast<work_deque*>(memory);
+	}
+
+	std::size_t capacity() const noexcept {
+		return mask_ + 1;
+	}
+
+	/**
+	 * Makes the deque usable by a new owner whose predecessor may have died
+	 * in the middle of try_pop(), leaving bottom below top. An element that
+	 * such a predecessor was popping may be lost. Owner only, before any
+	 * other call.
+	 */
+	void recover() noexcept {
+		const std::int64_t top = top_.load(std::memory_order_acquire);
+		if (bottom_.load(std::memory_order_relaxed) < top)
+			bottom_.store(top, std::memory_order_relaxed);
+	}
+
+	/**
+	 * Pushes @p value at the bottom. Returns false if the deque is full.
+	 * Owner only.
+	 */
+	bool try_push(const T& value) noexcept {
+		const std::int64_t bottom = bottom_.load(std::memory_order_relaxed);
+		const std::int64_t top = top_.load(std::memory_order_acquire);
+		if (bottom - top > static_cast<std::int64_t>(mask_))
+			return false;
+		cells()[bottom & mask_].store(value, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		bottom_.store(bottom + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	/**
+	 * Removes the element at the bottom (the one pushed last) and stores it
+	 * in @p value. Returns false if the deque is empty, or if a thief took
+	 * its last element first. Owner only.
+	 */
+	bool try_pop(T& value) noexcept {
+		const std::int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+		bottom_.store(bottom, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::int64_t top = top_.load(std::memory_order_relaxed);
+		if (top > bottom) {
+			bottom_.store(bottom + 1, std::memory_order_relaxed);
+			return false;
+		}
+		value = cells()[bottom & mask_].load(std::memory_order_relaxed);
+		if (top < bottom)
+			return true;
+
+		// The last element is taken like a thief would, by advancing top.
+		const bool taken = top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+		bottom_.store(bottom + 1, std::memory_order_relaxed);
+		return taken;
+	}
+
+	/**
+	 * Removes the element at the top (the one pushed first that is left) and
+	 * stores it in @p value. Returns false if the deque is empty, or if the
+	 * owner or another thief took that element first.
+	 */
+	bool try_steal(T& value) noexcept {
+		std::int64_t top = top_.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		const std::int64_t bottom = bottom_.load(std::memory_order_acquire);
+		if (top >= bottom)
+			return false;
+		value = cells()[top & mask_].load(std::memory_order_relaxed);
+		return top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+	}
+
+private:
+	// Thieves only touch top; the owner mostly touches bottom.
+	alignas(64) const std::int64_t mask_;
+	alignas(64) std::atomic<std::int64_t> top_;
+	alignas(64) std::atomic<std::int64_t> bottom_;
+
+	explicit work_deque(std::size_t capacity) noexcept : mask_(capacity - 1), top_(0), bottom_(0) {}
+
+	std::atomic<T>* cells() noexcept {
+		return reinterpret_cast<std::atomic<T>*>(this + 1);
+	}
+};
+
+/**
+ * Returns the smallest power of two that is not less than @p n.
+ */
+constexpr std::size_t next_power_of_two(std::size_t n, std::size_t power = 1) noexcept {
+	return power >= n ? power : next_power_of_two(n, power * 2);
+}
+
+#endif // RING_BUFFER_HPP
@@ -1,6 +1,46 @@
 /**
  * @file		shared_memory.hpp
- * An internal header.
+ * An internal header. Defines the layout of the shared memory segment
+ * through which 'distributed-prime-numbers' and its helpers communicate.
+ *
+ * The segment is a POSIX shared memory object that is mapped with mmap().
+ * Its layout is fixed and computed from the range plan before the segment is
+ * created, so no allocation happens inside it:
+ *
+ * - a segment_header (first page), which records the offsets of the other
+ *   parts;
+ * - one worker_slot per worker process, each on its own cache line;
+ * - the dispatch_state, from which workers claim ranges, and through which
+ *   they wake the driver when they publish a result;
+ * - one range_status per range;
+ * - the range_count + 1 boundaries of the ranges;
+ * - the retry queue;
+ * - one work deque per worker process, which holds the ranges of its share
+ *   that it has not claimed yet when ranges are assigned statically;
+ * - one result ring per worker process, each starting on its own page so
+ *   that no two workers ever write to the same page, and so that each can be
+ *   placed on the NUMA node of its worker. A worker writes the result of a
+ *   range straight into a slot of its ring: a result_header followed by
+ *   either the decimal text of the primes in the range, one per line, ready
+ *   to be written to standard output, or the packed bitmap of the range (bit
+ *   i of the bitmap of a range with offset o is set if o + i is prime),
+ *   depending on the result format of the segment. With the table format,
+ *   workers write the bitmap of each range straight into a prime table in a
+ *   file instead (see prime_table.hpp), and the slot only holds the header.
+ *   With the reduce format, the slot holds a fixed-size reduce_record of the
+ *   primes in the range instead of the primes themselves.
+ *
+ * With huge pages, the segment is a file on a hugetlbfs mount instead, or if
+ * there is none, or it has too few huge pages, a POSIX shared memory object
+ * for which transparent huge pages are requested. Its parts that are aligned
+ * to pages are then aligned to huge pages.
+ *
+ * Ranges take about the same time to test rather than having the same size
+ * (see partition.hpp), so the driver records where each one starts. Since
+ * workers may only claim ranges within a window of claim_window ranges past
+ * the ones the driver has printed, and the result rings have a fixed number
+ * of slots, the size of the segment depends on the size of the largest range
+ * and the number of workers, but hardly on the number of primes.
  *
  * @author		Jennifer Yao
  * @date		2015
@@ -10,24 +50,369 @@
 #ifndef SHARED_MEMORY_HPP
 #define SHARED_MEMORY_HPP
 
-#include <boost/interprocess/managed_shared_memory.hpp>
-#include <boost/interprocess/allocators/allocator.hpp>
-#include <boost/interprocess/containers/vector.hpp>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "ring_buffer.hpp"
+
+// Segment sizes and the offsets of the result rings within the segment are
+// multiples of kAlignment (the size of a page on most platforms), or of the
+// size of a huge page for segments backed by huge pages.
+#define kAlignment 4096
+
+// The size of a huge page where the kernel does not report it.
+#define kDefaultHugePageSize (UINT64_C(2) << 20)
+
+// The size of a cache line. Worker slots and queues are aligned to it.
+#define kCacheLineSize 64
+
+// The names of the IPC objects of a run consist of kIpcNamePrefix, the run
+// ID (the process ID of the driver) and the kind of object, so that
+// concurrent runs do not collide, and objects left behind by runs that died
+// can be told apart from those of live ones.
+#define kIpcNamePrefix PACKAGE_NAME "."
+
+// The directory in which POSIX shared memory objects appear on Linux.
+#define kSharedMemoryDirectory "/dev/shm"
+
+// Identifies a segment created by a compatible version of the driver.
+#define kSegmentMagic UINT64_C(0x3436303a34373731)
+#define kSegmentVersion 14
+
+// The result formats of a segment: the decimal text of the primes in each
+// range, the packed bitmap of each range, none, since workers store the
+// bitmap of each range in the prime table at segment_header::table_path, or
+// a reduce_record of each range, followed by its packed bitmap if the range
+// ends above segment_header::reduce_bitmap_from.
+#define kResultText 0
+#define kResultBitmap 1
+#define kResultTable 2
+#define kResultReduce 3
+
+// Stored in reduce_record::first_prime and last_prime of a range without
+// primes.
+#define kNoPrime UINT64_MAX
+
+// The longest path of a prime table file, including the terminating null.
+#define kMaxTablePathLength 1024
+
+// The number of slots in each worker's result ring.
+#define kResultRingCapacity 4
+
+// The number of ranges per worker that may be claimed past the last range
+// printed by the driver.
+#define kClaimWindowPerWorker 8
+
+// The capacity of each worker's work deque. It holds the ranges of the
+// worker's share within the claim window.
+#define kWorkDequeCapacity (2 * kClaimWindowPerWorker)
+
+// The interval, in microseconds, at which wait_for_completion() checks the
+// completion counter where it cannot sleep on it.
+#define kCompletionPollInterval 1000
 
-// NOTE: On Cygwin, Boost.Interprocess throws an exception if
-// managed_shared_memory objects are created with a size that is not a
-// multiple of 512 bytes for some reason.
-#define kAlignment 512
+// Stored in worker_slot::current_range while a worker is not testing a range.
+#define kNoRangeId UINT64_MAX
 
-#define kSharedMemorySegmentName PACKAGE_NAME ".prime-tables"
-#define kSemaphoreName PACKAGE_NAME ".helper-count"
-#define kPrimeTableArrayName "prime-tables"
+// The states of a range, stored in the low kRangeStateBits bits of
+// range_status::state.
+#define kRangePending 0
+#define kRangeClaimed 1
+#define kRangeDone 2
+#define kRangeStateBits 2
+#define kRangeStateMask ((UINT64_C(1) << kRangeStateBits) - 1)
 
-template<class T>
-using shm_allocator = boost::interprocess::allocator<T, boost::interprocess::managed_shared_memory::segment_manager>;
+/**
+ * The start of a slot in a result ring. The data_size bytes of the text or
+ * bitmap of the range follow it.
+ */
+struct result_header {
+	std::uint64_t range_id;
+	std::uint64_t offset;
+	std::uint64_t size;
+	std::uint64_t prime_count;
+	std::uint64_t data_size;
+};
+
+/**
+ * The aggregates of the primes in a range, which follow its result_header
+ * with the reduce format. Records of consecutive ranges are combined in
+ * order: the gap between the last prime of one and the first prime of the
+ * next is only known then.
+ */
+struct reduce_record {
+	std::uint64_t prime_count;
+	// The sum of the primes, as a 128-bit integer.
+	std::uint64_t sum_low;
+	std::uint64_t sum_high;
+	std::uint64_t first_prime;
+	std::uint64_t last_prime;
+	// The largest difference between consecutive primes in the range, and
+	// the smaller prime of the first such pair.
+	std::uint64_t max_gap;
+	std::uint64_t max_gap_start;
+};
+
+/**
+ * Per-worker state, written only by the worker that owns the slot.
+ */
+struct alignas(kCacheLineSize) worker_slot {
+	std::atomic<std::uint64_t> pid;
+	std::atomic<std::uint64_t> current_range;
+	std::atomic<std::uint64_t> ranges_done;
+	// The number of integers tested so far, including those of the range
+	// being tested, which is updated at every heartbeat.
+	std::atomic<std::uint64_t> numbers_tested;
+};
+
+static_assert(sizeof(worker_slot) == kCacheLineSize, "worker_slot must fill exactly one cache line.");
+
+/**
+ * The progress of a range. The state word holds the range's state in its low
+ * kRangeStateBits bits, and the number of times it has been claimed in the
+ * others, so that a worker whose claim has expired cannot complete the range
+ * after another worker has claimed it again.
+ *
+ * A range moves from pending to claimed when a worker claims it, from
+ * claimed to done when that worker has tested it and published the result,
+ * and from claimed back to pending when the driver re-dispatches it because
+ * its worker crashed or stopped updating the heartbeat. Since a range is
+ * only marked done after its result is published, a worker that fails at
+ * any point leaves its range claimed, and the driver recovers it.
+ *
+ * An idle worker may also run a backup of a range that has been claimed for
+ * a long time, under the same claim as its owner (see back_up_range()).
+ * Each of the two publishes its result if it still holds the claim when it
+ * has finished, so both may publish one, and the driver ignores whichever
+ * arrives second; once one of them has marked the range done, the other one
+ * sees that it no longer holds the claim, and abandons the range.
+ */
+struct range_status {
+	std::atomic<std::uint64_t> state;
+	std::atomic<std::uint64_t> owner;
+	// The time of the owner's last sign of progress, in steady_clock
+	// nanoseconds (CLOCK_MONOTONIC on Linux, which all processes share), or
+	// 0 if the owner has not written it yet.
+	std::atomic<std::uint64_t> heartbeat;
+	// The time at which the range was last claimed, or 0 if not written yet.
+	std::atomic<std::uint64_t> claimed_at;
+	// The claim under which a backup of the range was last started.
+	std::atomic<std::uint64_t> backup;
+};
+
+/**
+ * Shared dispatch state. Each worker claims a new range by incrementing
+ * next_range, as long as it is less than printed + claim_window, and takes
+ * re-dispatched ranges from the retry queue. printed is the number of ranges
+ * the driver has printed so far. Workers exit once the driver sets stop.
+ *
+ * Workers increment completions whenever they publish a result. The driver
+ * sleeps on it (with a futex on Linux) while driver_waiting is set, and
+ * workers only make the system call that wakes it then.
+ */
+struct dispatch_state {
+	alignas(kCacheLineSize) std::atomic<std::uint64_t> next_range;
+	alignas(kCacheLineSize) std::atomic<std::uint64_t> printed;
+	alignas(kCacheLineSize) std::atomic<std::uint64_t> stop;
+	alignas(kCacheLineSize) std::atomic<std::uint32_t> completions;
+	std::atomic<std::uint32_t> driver_waiting;
+};
 
-template<class T>
-using shm_vector = boost::interprocess::vector<T, shm_allocator<T>>;
+static_assert(sizeof(dispatch_state) == 4 * kCacheLineSize, "The members of dispatch_state must be on separate cache lines.");
+static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t), "A futex must be a plain 32-bit word.");
+
+/**
+ * Returns the current time for range_status::heartbeat.
+ */
+inline std::uint64_t heartbeat_now() noexcept {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Tells the driver that a result has been published.
+ */
+inline void signal_completion(dispatch_state& dispatch) noexcept {
+	// Either the driver sees the new count before it sleeps, or this sees
+	// that it sleeps (or is about to) and wakes it.
+	dispatch.completions.fetch_add(1, std::memory_order_seq_cst);
+	if (dispatch.driver_waiting.load(std::memory_order_seq_cst)) {
+#if defined(__linux__) && defined(SYS_futex)
+		syscall(SYS_futex, &dispatch.completions, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+#endif
+	}
+}
+
+/**
+ * Waits until the completion counter of @p dispatch differs from @p seen, or
+ * until @p timeout_ns nanoseconds have passed. Returns true if it differs.
+ * Only the driver may wait.
+ */
+inline bool wait_for_completion(dispatch_state& dispatch, std::uint32_t seen, std::uint64_t timeout_ns) noexcept {
+	dispatch.driver_waiting.store(1, std::memory_order_seq_cst);
+#if defined(__linux__) && defined(SYS_futex)
+	// The futex is shared between processes, so FUTEX_PRIVATE_FLAG must not
+	// be set. The kernel only sleeps if the counter still equals seen.
+	if (dispatch.completions.load(std::memory_order_seq_cst) == seen) {
+		timespec timeout;
+		timeout.tv_sec = static_cast<time_t>(timeout_ns / 1000000000);
+		timeout.tv_nsec = static_cast<long>(timeout_ns % 1000000000);
+		syscall(SYS_futex, &dispatch.completions, FUTEX_WAIT, seen, &timeout, nullptr, 0);
+	}
+#else
+	const std::uint64_t deadline = heartbeat_now() + timeout_ns;
+	while (dispatch.completions.load(std::memory_order_seq_cst) == seen && heartbeat_now() < deadline)
+		usleep(kCompletionPollInterval);
+#endif
+	dispatch.driver_waiting.store(0, std::memory_order_relaxed);
+	return dispatch.completions.load(std::memory_order_acquire) != seen;
+}
+
+/**
+ * Claims the pending range described by @p status for worker @p worker_id.
+ * Returns false if the range is not pending. Otherwise, stores the new state
+ * word in @p claim, which identifies this claim to complete_range().
+ * A range ID may be in more than one queue or deque at a time, so several
+ * workers may try to claim the same range; only the one that wins writes the
+ * heartbeat, the claim time and the owner. Until it has, readers see the
+ * heartbeat and the claim time as 0 (see expire_range()), and the owner
+ * stale.
+ */
+inline bool claim_range(range_status& status, std::uint64_t worker_id, std::uint64_t& claim) noexcept {
+	std::uint64_t state = status.state.load(std::memory_order_acquire);
+	if ((state & kRangeStateMask) != kRangePending)
+		return false;
+	claim = (state & ~kRangeStateMask) + (UINT64_C(1) << kRangeStateBits) + kRangeClaimed;
+	if (!status.state.compare_exchange_strong(state, claim, std::memory_order_acq_rel))
+		return false;
+	const std::uint64_t now = heartbeat_now();
+	status.heartbeat.store(now, std::memory_order_relaxed);
+	status.claimed_at.store(now, std::memory_order_relaxed);
+	status.owner.store(worker_id, std::memory_order_relaxed);
+	return true;
+}
+
+/**
+ * Starts a backup of the claimed range described by @p status, under the
+ * claim of its owner, which is stored in @p claim. Returns false if the range
+ * is not claimed, or if a backup has already been started under its current
+ * claim, so that each claim has at most one backup.
+ */
+inline bool back_up_range(range_status& status, std::uint64_t& claim) noexcept {
+	const std::uint64_t state = status.state.load(std::memory_order_acquire);
+	if ((state & kRangeStateMask) != kRangeClaimed)
+		return false;
+	std::uint64_t backup = status.backup.load(std::memory_order_relaxed);
+	if (backup == state || !status.backup.compare_exchange_strong(backup, state, std::memory_order_acq_rel))
+		return false;
+	claim = state;
+	return true;
+}
+
+/**
+ * Returns true if @p claim is still the current claim of the range described
+ * by @p status.
+ */
+inline bool holds_claim(const range_status& status, std::uint64_t claim) noexcept {
+	return status.state.load(std::memory_order_relaxed) == claim;
+}
+
+/**
+ * Marks the range claimed by @p claim as done. Returns false if the claim
+ * has expired in the meantime.
+ */
+inline bool complete_range(range_status& status, std::uint64_t claim) noexcept {
+	return status.state.compare_exchange_strong(claim, (claim & ~kRangeStateMask) | kRangeDone, std::memory_order_acq_rel);
+}
+
+/**
+ * Returns the claimed range described by @p status to the pending state.
+ * Returns false if the range was not claimed. The heartbeat and the claim
+ * time are reset to 0 first, as in the zero-filled segment, so that the next
+ * claim never shows those of this one before it has written its own.
+ */
+inline bool expire_range(range_status& status) noexcept {
+	std::uint64_t state = status.state.load(std::memory_order_acquire);
+	if ((state & kRangeStateMask) != kRangeClaimed)
+		return false;
+	status.heartbeat.store(0, std::memory_order_relaxed);
+	status.claimed_at.store(0, std::memory_order_relaxed);
+	return status.state.compare_exchange_strong(state, (state & ~kRangeStateMask) | kRangePending, std::memory_order_acq_rel);
+}
+
+/**
+ * The first part of the segment.
+ */
+struct segment_header {
+	std::uint64_t magic;
+	std::uint64_t version;
+	std::uint64_t segment_size;
+	std::uint64_t max_prime;
+	std::uint64_t max_range_size;
+	std::uint64_t range_count;
+	std::uint64_t worker_count;
+	std::uint64_t claim_window;
+	std::uint64_t result_format;
+	// Non-zero if idle workers may run backups of ranges claimed by others.
+	std::uint64_t speculation;
+	// Non-zero if worker i pushes ranges i, i + worker_count, and so on onto
+	// its work deque and claims them from there, instead of claiming the next
+	// range from the cursor; it still takes re-dispatched ranges from the
+	// retry queue, and steals from the deques of others when it runs out.
+	std::uint64_t static_assignment;
+	std::uint64_t worker_slots_offset;
+	std::uint64_t dispatch_offset;
+	std::uint64_t range_statuses_offset;
+	std::uint64_t range_offsets_offset;
+	std::uint64_t retry_queue_offset;
+	std::uint64_t retry_queue_capacity;
+	std::uint64_t work_deques_offset;
+	std::uint64_t work_deque_stride;
+	std::uint64_t result_rings_offset;
+	std::uint64_t result_ring_stride;
+	std::uint64_t result_slot_size;
+	// With kResultReduce, the results of ranges that end above this integer
+	// carry their bitmap after their reduce_record, so that the driver can
+	// reduce the part of the range up to the last prime it wants.
+	std::uint64_t reduce_bitmap_from;
+	// With kResultTable, the path of the prime table file.
+	char table_path[kMaxTablePathLength];
+};
+
+/**
+ * Returns the end of the ranges that may have been claimed so far: those
+ * below the cursor, or with static assignment, those within the claim
+ * window.
+ */
+inline std::uint64_t claimed_end(const segment_header& header, const dispatch_state& dispatch) noexcept {
+	if (header.static_assignment)
+		return std::min(header.range_count, dispatch.printed.load(std::memory_order_acquire) + header.claim_window);
+	return std::min(header.range_count, dispatch.next_range.load(std::memory_order_relaxed));
+}
 
 /**
  * Returns the given object size rounded up to the nearest specified
@@ -41,7 +426,467 @@ using shm_vector = boost::interprocess::vector<T, shm_allocator<T>>;
  */
 template<std::size_t Alignment>
 constexpr std::size_t align(std::size_t n) noexcept {
-	return n + (Alignment - 1) & ~(Alignment - 1);
+	return (n + (Alignment - 1)) & ~(Alignment - 1);
 }
 
+/**
+ * Returns @p n rounded up to a multiple of @p alignment, like align(), for
+ * alignments that are only known at run time, such as the size of a huge
+ * page.
+ * @pre @p alignment is a power of two.
+ */
+inline std::size_t align_to(std::size_t n, std::size_t alignment) noexcept {
+	return (n + (alignment - 1)) & ~(alignment - 1);
+}
+
+/**
+ * Returns the number of bytes in a packed bitmap of @p bit_count bits.
+ */
+constexpr std::size_t bitmap_size(std::size_t bit_count) noexcept {
+	return (bit_count + CHAR_BIT - 1) / CHAR_BIT;
+}
+
+/**
+ * Stores the aggregates of the first @p max_count primes marked in the packed
+ * bitmap of the range [offset, offset + size) in @p record.
+ */
+inline void reduce_primes(const unsigned char* bitmap, std::uint64_t offset, std::uint64_t size, reduce_record& record, std::uint64_t max_count = UINT64_MAX) noexcept {
+	record = reduce_record{0, 0, 0, kNoPrime, kNoPrime, 0, 0};
+	for (std::uint64_t i = 0; i < bitmap_size(size); i++) {
+		if (bitmap[i] == 0)
+			continue;
+		for (unsigned bit = 0; bit < CHAR_BIT; bit++) {
+			if (!(bitmap[i] & (1u << bit)))
+				continue;
+			if (record.prime_count == max_count)
+				return;
+			const std::uint64_t n = offset + i * CHAR_BIT + bit;
+			record.prime_count++;
+			record.sum_low += n;
+			if (record.sum_low < n)
+				record.sum_high++;
+			if (record.last_prime == kNoPrime)
+				record.first_prime = n;
+			else if (n - record.last_prime > record.max_gap) {
+				record.max_gap = n - record.last_prime;
+				record.max_gap_start = record.last_prime;
+			}
+			record.last_prime = n;
+		}
+	}
+}
+
+/**
+ * Returns the number of decimal digits of @p n.
+ */
+inline std::size_t decimal_digit_count(std::uint64_t n) noexcept {
+	std::size_t count = 1;
+	for (; n >= 10; n /= 10)
+		count++;
+	return count;
+}
+
+/**
+ * Returns the largest size of the text of the primes in a range of
+ * @p range_size integers below @p max_prime, one per line. At most 8 of any
+ * 30 consecutive integers are coprime to 2, 3 and 5, and so may be prime,
+ * besides 2, 3 and 5 themselves.
+ */
+inline std::size_t max_text_size(std::uint64_t range_size, std::uint64_t max_prime) noexcept {
+	const std::uint64_t max_prime_count = std::min<std::uint64_t>(range_size, range_size / 30 * 8 + 8 + 3);
+	return max_prime_count * (decimal_digit_count(max_prime) + 1);
+}
+
+/**
+ * Returns the size of range @p range_id when the integers in [0, max_prime)
+ * are divided into ranges of @p chunk_size integers. Only the last range may
+ * be shorter than @p chunk_size.
+ */
+inline std::uint64_t range_size(std::uint64_t range_id, std::uint64_t max_prime, std::uint64_t chunk_size) noexcept {
+	const std::uint64_t offset = range_id * chunk_size;
+	return max_prime - offset < chunk_size ? max_prime - offset : chunk_size;
+}
+
+/**
+ * Computes the layout of a segment for the integers in [0, @p max_prime),
+ * divided into @p range_count ranges of at most @p max_range_size integers,
+ * @p worker_count worker processes and results in @p result_format, and
+ * stores it in @p header. The result rings and the size of the segment are
+ * aligned to @p page_size.
+ * @pre @p range_count != 0.
+ * @pre @p page_size is a power of two, and at least kAlignment.
+ */
+inline void plan_segment(segment_header& header, std::uint64_t max_prime, std::uint64_t range_count, std::uint64_t max_range_size, std::uint64_t worker_count, std::uint64_t result_format, std::size_t page_size = kAlignment) {
+	header.magic = kSegmentMagic;
+	header.version = kSegmentVersion;
+	header.max_prime = max_prime;
+	header.max_range_size = max_range_size;
+	header.range_count = range_count;
+	header.worker_count = worker_count;
+	header.claim_window = worker_count * kClaimWindowPerWorker;
+	header.result_format = result_format;
+	header.speculation = 1;
+	header.static_assignment = 0;
+	header.retry_queue_capacity = next_power_of_two(range_count);
+	header.reduce_bitmap_from = max_prime;
+	header.table_path[0] = '\0';
+	std::size_t data_size = 0;
+	if (result_format == kResultText)
+		data_size = max_text_size(max_range_size, max_prime);
+	else if (result_format == kResultBitmap)
+		data_size = bitmap_size(max_range_size);
+	else if (result_format == kResultReduce)
+		data_size = sizeof(reduce_record) + bitmap_size(max_range_size);
+	header.result_slot_size = align<kCacheLineSize>(sizeof(result_header) + data_size);
+	header.result_ring_stride = align_to(spsc_ring::required_size(kResultRingCapacity, header.result_slot_size), page_size);
+	header.work_deque_stride = align<kCacheLineSize>(work_deque<std::uint64_t>::required_size(kWorkDequeCapacity));
+
+	std::size_t size = align<kCacheLineSize>(sizeof(segment_header));
+	header.worker_slots_offset = size;
+	size += worker_count * sizeof(worker_slot);
+	header.dispatch_offset = size;
+	size += sizeof(dispatch_state);
+	header.range_statuses_offset = size;
+	size = align<kCacheLineSize>(size + range_count * sizeof(range_status));
+	header.range_offsets_offset = size;
+	size = align<kCacheLineSize>(size + (range_count + 1) * sizeof(std::uint64_t));
+	header.retry_queue_offset = size;
+	size = align<kCacheLineSize>(size + mpmc_ring<std::uint64_t>::required_size(header.retry_queue_capacity));
+	header.work_deques_offset = size;
+	size += worker_count * header.work_deque_stride;
+	size = align_to(size, page_size);
+	header.result_rings_offset = size;
+	size += worker_count * header.result_ring_stride;
+	header.segment_size = size;
+}
+
+inline std::string ipc_name(const std::string& run_id, const char* object) {
+	return kIpcNamePrefix + run_id + "." + object;
+}
+
+inline std::string segment_name(const std::string& run_id) {
+	return "/" + ipc_name(run_id, "prime-tables");
+}
+
+/**
+ * A request from the driver to the zygote of its run (a helper started with
+ * --zygote) to fork worker process @p worker_id. The zygote answers with the
+ * process ID of the new worker process as an std::int64_t, or -1.
+ */
+struct zygote_request {
+	std::uint64_t worker_id;
+	// The NUMA node to pin the worker process to, or -1.
+	std::int64_t node;
+};
+
+/**
+ * Returns the directory on which a hugetlbfs file system is mounted, or an
+ * empty string if there is none.
+ */
+inline std::string huge_page_directory() {
+	std::ifstream mounts("/proc/mounts");
+	std::string line;
+	while (std::getline(mounts, line)) {
+		std::istringstream fields(line);
+		std::string device, directory, type;
+		if (fields >> device >> directory >> type && type == "hugetlbfs")
+			return directory;
+	}
+	return std::string();
+}
+
+/**
+ * Returns the size of the huge pages of the hugetlbfs mount, or if there is
+ * none, of transparent huge pages.
+ */
+inline std::size_t huge_page_size() {
+	const std::string directory = huge_page_directory();
+	struct statvfs status;
+	if (!directory.empty() && statvfs(directory.c_str(), &status) == 0 && status.f_bsize >= kAlignment)
+		return status.f_bsize;
+	std::ifstream file("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size");
+	std::size_t size;
+	if (file >> size && size >= kAlignment && (size & (size - 1)) == 0)
+		return size;
+	return kDefaultHugePageSize;
+}
+
+/**
+ * Removes the shared memory objects of runs whose
+ * driver is no longer running, such as those of a driver that was killed
+ * before it could clean up. Does nothing where they cannot be listed.
+ */
+inline void reap_stale_ipc_objects() {
+	const std::string huge_pages = huge_page_directory();
+	const std::string prefix = kIpcNamePrefix;
+	for (const std::string& path : {std::string(kSharedMemoryDirectory), huge_pages}) {
+		DIR* directory = path.empty() ? nullptr : opendir(path.c_str());
+		if (!directory)
+			continue;
+		while (const dirent* entry = readdir(directory)) {
+			const std::string name = entry->d_name;
+			if (name.compare(0, prefix.size(), prefix) != 0)
+				continue;
+
+			// Parse the run ID, which must be followed by a dot.
+			const std::string::size_type run_id_end = name.find('.', prefix.size());
+			const std::string run_id = name.substr(prefix.size(), run_id_end - prefix.size());
+			if (run_id_end == std::string::npos || run_id.empty() || run_id.size() > 9 || run_id.find_first_not_of("0123456789") != std::string::npos)
+				continue;
+			if (kill(static_cast<pid_t>(std::stol(run_id)), 0) == 0 || errno != ESRCH)
+				continue;
+
+			if (path == huge_pages)
+				unlink((path + "/" + name).c_str());
+			else
+				shm_unlink(("/" + name).c_str());
+		}
+		closedir(directory);
+	}
+}
+
+/**
+ * Asks for the pages of the @p size bytes of shared memory at @p address,
+ * which must be page-aligned, to be allocated on NUMA node @p node when they
+ * are first touched. The policy applies to every mapping of the shared
+ * memory object. Pages fall back to other nodes if @p node is out of memory.
+ * Returns false if the policy could not be set.
+ */
+inline bool prefer_node(void* address, std::size_t size, int node) noexcept {
+#if defined(__linux__) && defined(SYS_mbind)
+	// MPOL_PREFERRED, from <numaif.h>, which is only available with libnuma.
+	const int preferred_policy = 1;
+	const std::size_t bits_per_word = sizeof(unsigned long) * CHAR_BIT;
+	unsigned long node_mask[1024 / (sizeof(unsigned long) * CHAR_BIT)] = {};
+	if (node < 0 || static_cast<std::size_t>(node) >= sizeof(node_mask) * CHAR_BIT)
+		return false;
+	node_mask[node / bits_per_word] |= 1ul << (node % bits_per_word);
+	return syscall(SYS_mbind, address, size, preferred_policy, node_mask, sizeof(node_mask) * CHAR_BIT, 0) == 0;
+#else
+	static_cast<void>(address);
+	static_cast<void>(size);
+	static_cast<void>(node);
+	return false;
+#endif
+}
+
+/**
+ * A mapping of a POSIX shared memory object.
+ */
+class shared_segment {
+public:
+	/**
+	 * Creates a new zero-filled shared memory object named @p name of
+	 * @p size bytes and maps it. With @p huge_pages, the object is a file of
+	 * that name on the hugetlbfs mount if there is one and it has enough
+	 * huge pages left, and otherwise a POSIX shared memory object for which
+	 * transparent huge pages are requested; @p size must then be a multiple
+	 * of huge_page_size().
+	 * @throws std::system_error if the object already exists or cannot be
+	 *         created or mapped.
+	 */
+	static shared_segment create(const std::string& name, std::size_t size, bool huge_pages = false) {
+		if (huge_pages) {
+			const std::string directory = huge_page_directory();
+			const int fd = directory.empty() ? -1 : ::open((directory + name).c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+			if (fd != -1) {
+				// Mapping fails if there are not enough huge pages left, in
+				// which case the constructor closes fd.
+				if (ftruncate(fd, size) == 0) {
+					try {
+						return shared_segment(name, fd, size);
+					}
+					catch (const std::system_error&) {
+					}
+				}
+				else {
+					close(fd);
+				}
+				unlink((directory + name).c_str());
+			}
+		}
+
+		const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+		if (fd == -1)
+			throw std::system_error(errno, std::generic_category(), "shm_open " + name);
+		if (ftruncate(fd, size) == -1) {
+			const int error = errno;
+			close(fd);
+			shm_unlink(name.c_str());
+			throw std::system_error(error, std::generic_category(), "ftruncate " + name);
+		}
+		shared_segment segment(name, fd, size);
+#if defined(MADV_HUGEPAGE)
+		if (huge_pages)
+			madvise(segment.data_, segment.size_, MADV_HUGEPAGE);
+#endif
+		return segment;
+	}
+
+	/**
+	 * Opens the existing shared memory object named @p name, which may be on
+	 * the hugetlbfs mount, with @p flags (O_RDONLY or O_RDWR), and returns
+	 * its file descriptor, or -1.
+	 */
+	static int open_descriptor(const std::string& name, int flags) {
+		int fd = shm_open(name.c_str(), flags, 0);
+		if (fd == -1 && errno == ENOENT) {
+			const std::string directory = huge_page_directory();
+			if (!directory.empty())
+				fd = ::open((directory + name).c_str(), flags | O_CLOEXEC);
+			if (fd == -1)
+				errno = ENOENT;
+		}
+		return fd;
+	}
+
+	/**
+	 * Maps the existing shared memory object named @p name.
+	 * @throws std::system_error if the object cannot be opened or mapped.
+	 */
+	static shared_segment open(const std::string& name) {
+		const int fd = open_descriptor(name, O_RDWR);
+		if (fd == -1)
+			throw std::system_error(errno, std::generic_category(), "shm_open " + name);
+		struct stat status;
+		if (fstat(fd, &status) == -1) {
+			const int error = errno;
+			close(fd);
+			throw std::system_error(error, std::generic_category(), "fstat " + name);
+		}
+		return shared_segment(name, fd, status.st_size);
+	}
+
+	/**
+	 * Creates the file at @p path, or truncates it if it exists, extends it to
+	 * @p size bytes and maps it. No blocks are allocated for the file until
+	 * its pages are written, so it reads as zeros and may be larger than
+	 * memory.
+	 * @throws std::system_error if the file cannot be created or mapped.
+	 */
+	static shared_segment create_file(const std::string& path, std::size_t size) {
+		const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (fd == -1)
+			throw std::system_error(errno, std::generic_category(), "open " + path);
+		if (ftruncate(fd, size) == -1) {
+			const int error = errno;
+			close(fd);
+			throw std::system_error(error, std::generic_category(), "ftruncate " + path);
+		}
+		return shared_segment(path, fd, size);
+	}
+
+	/**
+	 * Maps the existing file at @p path.
+	 * @throws std::system_error if the file cannot be opened or mapped.
+	 */
+	static shared_segment open_file(const std::string& path) {
+		const int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+		if (fd == -1)
+			throw std::system_error(errno, std::generic_category(), "open " + path);
+		struct stat status;
+		if (fstat(fd, &status) == -1) {
+			const int error = errno;
+			close(fd);
+			throw std::system_error(error, std::generic_category(), "fstat " + path);
+		}
+		return shared_segment(path, fd, status.st_size);
+	}
+
+	/**
+	 * Removes the shared memory object named @p name, whether it is a POSIX
+	 * shared memory object or on the hugetlbfs mount. Existing mappings stay
+	 * valid.
+	 */
+	static void remove(const std::string& name) {
+		shm_unlink(name.c_str());
+		const std::string directory = huge_page_directory();
+		if (!directory.empty())
+			unlink((directory + name).c_str());
+	}
+
+	shared_segment(shared_segment&& other) noexcept : data_(other.data_), size_(other.size_) {
+		other.data_ = nullptr;
+		other.size_ = 0;
+	}
+
+	shared_segment(const shared_segment&) = delete;
+	shared_segment& operator=(const shared_segment&) = delete;
+
+	~shared_segment() {
+		if (data_)
+			munmap(data_, size_);
+	}
+
+	void* data() const noexcept {
+		return data_;
+	}
+
+	std::size_t size() const noexcept {
+		return size_;
+	}
+
+	/**
+	 * Tells the kernel how the mapping is going to be accessed, such as
+	 * MADV_SEQUENTIAL before a single pass over it. This is only a hint.
+	 */
+	void advise(int advice) const noexcept {
+		madvise(data_, size_, advice);
+	}
+
+	/**
+	 * Returns a pointer to the object of type @p T at byte @p offset.
+	 */
+	template<class T>
+	T* at(std::uint64_t offset) const noexcept {
+		return reinterpret_cast<T*>(static_cast<unsigned char*>(data_) + offset);
+	}
+
+	segment_header& header() const noexcept {
+		return *at<segment_header>(0);
+	}
+
+	worker_slot* worker_slots() const noexcept {
+		return at<worker_slot>(header().worker_slots_offset);
+	}
+
+	dispatch_state& dispatch() const noexcept {
+		return *at<dispatch_state>(header().dispatch_offset);
+	}
+
+	range_status* range_statuses() const noexcept {
+		return at<range_status>(header().range_statuses_offset);
+	}
+
+	// Range i is [range_offsets()[i], range_offsets()[i + 1]).
+	std::uint64_t* range_offsets() const noexcept {
+		return at<std::uint64_t>(header().range_offsets_offset);
+	}
+
+	mpmc_ring<std::uint64_t>* retry_queue() const noexcept {
+		return mpmc_ring<std::uint64_t>::attach(at<void>(header().retry_queue_offset));
+	}
+
+	work_deque<std::uint64_t>* work_deque_of(std::uint64_t worker_id) const noexcept {
+		return work_deque<std::uint64_t>::attach(at<void>(header().work_deques_offset + worker_id * header().work_deque_stride));
+	}
+
+	spsc_ring* result_ring(std::uint64_t worker_id) const noexcept {
+		return spsc_ring::attach(at<void>(header().result_rings_offset + worker_id * header().result_ring_stride));
+	}
+
+private:
+	void* data_;
+	std::size_t size_;
+
+	shared_segment(const std::string& name, int fd, std::size_t size) : data_(nullptr), size_(size) {
+		void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		const int error = errno;
+		close(fd);
+		if (data == MAP_FAILED)
+			throw std::system_error(error, std::generic_category(), "mmap " + name);
+		data_ = data;
+	}
+};
+
 #endif // SHARED_MEMORY_HPP
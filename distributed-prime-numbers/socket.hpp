@@ -0,0 +1,350 @@
+/**
+ * @file		socket.hpp
+ * An internal header. Thin wrappers around blocking TCP and Unix-domain
+ * sockets.
+ *
+ * @author		Jennifer Yao
+ * @date		2015
+ * @copyright	All rights reserved.
+ */
+
+#ifndef SOCKET_HPP
+#define SOCKET_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Writing to a socket whose peer has gone away must fail with EPIPE instead
+// of killing the process with SIGPIPE.
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/**
+ * Owns a socket file descriptor and closes it on destruction.
+ */
+class socket_handle {
+public:
+	explicit socket_handle(int fd = -1) noexcept : fd_(fd) {}
+
+	socket_handle(socket_handle&& other) noexcept : fd_(other.fd_) {
+		other.fd_ = -1;
+	}
+
+	socket_handle& operator=(socket_handle&& other) noexcept {
+		if (this != &other) {
+			reset();
+			fd_ = other.fd_;
+			other.fd_ = -1;
+		}
+		return *this;
+	}
+
+	socket_handle(const socket_handle&) = delete;
+	socket_handle& operator=(const socket_handle&) = delete;
+
+	~socket_handle() {
+		reset();
+	}
+
+	int get() const noexcept {
+		return fd_;
+	}
+
+	void reset() noexcept {
+		if (fd_ != -1)
+			close(fd_);
+		fd_ = -1;
+	}
+
+private:
+	int fd_;
+};
+
+/**
+ * Splits an address of the form <host>:<port> at its last colon. The host
+ * may be empty. Returns false if @p address has no colon or no port.
+ */
+inline bool parse_address(const std::string& address, std::string& host, std::string& port) {
+	const std::string::size_type colon = address.rfind(':');
+	if (colon == std::string::npos || colon + 1 == address.size())
+		return false;
+	host = address.substr(0, colon);
+	port = address.substr(colon + 1);
+	return true;
+}
+
+namespace detail {
+	// Resolves @p host and @p port, and returns the first address for which
+	// @p try_address(fd, address) succeeds on a new socket.
+	template<class Function>
+	socket_handle open_tcp_socket(const std::string& host, const std::string& port, int flags, const char* what, Function try_address) {
+		addrinfo hints = addrinfo();
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = flags;
+		addrinfo* addresses;
+		const int error = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &addresses);
+		if (error != 0)
+			throw std::runtime_error(std::string(what) + " " + host + ":" + port + ": " + gai_strerror(error));
+
+		int last_error = 0;
+		for (addrinfo* address = addresses; address; address = address->ai_next) {
+			socket_handle socket(::socket(address->ai_family, address->ai_socktype, address->ai_protocol));
+			if (socket.get() == -1 || !try_address(socket.get(), *address)) {
+				last_error = errno;
+				continue;
+			}
+			freeaddrinfo(addresses);
+			return socket;
+		}
+		freeaddrinfo(addresses);
+		throw std::system_error(last_error, std::generic_category(), std::string(what) + " " + host + ":" + port);
+	}
+}
+
+/**
+ * Returns a socket that listens on @p host (all interfaces if empty) and
+ * @p port. If @p port is "0", the system picks a free port; see
+ * local_port().
+ * @throws std::runtime_error or std::system_error on failure.
+ */
+inline socket_handle listen_tcp(const std::string& host, const std::string& port, int backlog = SOMAXCONN) {
+	return detail::open_tcp_socket(host, port, AI_PASSIVE, "listen", [backlog](int fd, const addrinfo& address) {
+		const int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		return bind(fd, address.ai_addr, address.ai_addrlen) == 0 && listen(fd, backlog) == 0;
+	});
+}
+
+/**
+ * Returns a socket connected to @p host and @p port.
+ * @throws std::runtime_error or std::system_error on failure.
+ */
+inline socket_handle connect_tcp(const std::string& host, const std::string& port) {
+	socket_handle socket = detail::open_tcp_socket(host, port, 0, "connect", [](int fd, const addrinfo& address) {
+		return connect(fd, address.ai_addr, address.ai_addrlen) == 0;
+	});
+	// Frames are written whole, so there is nothing to gain from Nagle's
+	// algorithm delaying small ones.
+	const int on = 1;
+	setsockopt(socket.get(), IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	return socket;
+}
+
+/**
+ * Returns the port that the socket @p fd is bound to.
+ * @throws std::system_error if getsockname() fails.
+ */
+inline std::uint16_t local_port(int fd) {
+	sockaddr_storage address;
+	socklen_t length = sizeof(address);
+	if (getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) == -1)
+		throw std::system_error(errno, std::generic_category(), "getsockname");
+	if (address.ss_family == AF_INET6)
+		return ntohs(reinterpret_cast<const sockaddr_in6&>(address).sin6_port);
+	return ntohs(reinterpret_cast<const sockaddr_in&>(address).sin_port);
+}
+
+/**
+ * Writes all @p size bytes at @p data to the socket @p fd.
+ * @throws std::system_error if the socket fails.
+ */
+inline void send_all(int fd, const void* data, std::size_t size) {
+	const char* p = static_cast<const char*>(data);
+	while (size > 0) {
+		const ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			throw std::system_error(errno, std::generic_category(), "send");
+		}
+		p += n;
+		size -= n;
+	}
+}
+
+/**
+ * Reads exactly @p size bytes from the socket @p fd into @p data. Returns
+ * false if the peer closed the connection before any byte was read.
+ * @throws std::system_error if the socket fails, or std::runtime_error if the
+ *         connection is closed after some but not all bytes were read.
+ */
+inline bool receive_all(int fd, void* data, std::size_t size) {
+	char* p = static_cast<char*>(data);
+	const std::size_t requested = size;
+	while (size > 0) {
+		const ssize_t n = recv(fd, p, size, 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			throw std::system_error(errno, std::generic_category(), "recv");
+		}
+		if (n == 0) {
+			if (size == requested)
+				return false;
+			throw std::runtime_error("connection closed in the middle of a frame");
+		}
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+namespace detail {
+	// Fills in @p address for the Unix-domain socket at @p path.
+	inline socklen_t make_unix_address(sockaddr_un& address, const std::string& path) {
+		address = sockaddr_un();
+		address.sun_family = AF_UNIX;
+		if (path.empty() || path.size() >= sizeof(address.sun_path))
+			throw std::runtime_error("invalid socket path '" + path + "'");
+		std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+		return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.size() + 1);
+	}
+}
+
+/**
+ * Returns a socket connected to the Unix-domain socket at @p path.
+ * @throws std::runtime_error or std::system_error on failure.
+ */
+inline socket_handle connect_unix(const std::string& path) {
+	sockaddr_un address;
+	const socklen_t length = detail::make_unix_address(address, path);
+	socket_handle socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+	if (socket.get() == -1 || connect(socket.get(), reinterpret_cast<const sockaddr*>(&address), length) == -1)
+		throw std::system_error(errno, std::generic_category(), "connect " + path);
+	return socket;
+}
+
+/**
+ * Returns a socket that listens at @p path. A socket file left behind by a
+ * process that is no longer listening is replaced.
+ * @throws std::runtime_error or std::system_error on failure, including if
+ *         another process is listening at @p path.
+ */
+inline socket_handle listen_unix(const std::string& path, int backlog = SOMAXCONN) {
+	sockaddr_un address;
+	const socklen_t length = detail::make_unix_address(address, path);
+	socket_handle socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+	if (socket.get() == -1)
+		throw std::system_error(errno, std::generic_category(), "socket");
+	if (bind(socket.get(), reinterpret_cast<const sockaddr*>(&address), length) == -1) {
+		if (errno != EADDRINUSE)
+			throw std::system_error(errno, std::generic_category(), "bind " + path);
+		socket_handle probe(::socket(AF_UNIX, SOCK_STREAM, 0));
+		if (probe.get() == -1 || connect(probe.get(), reinterpret_cast<const sockaddr*>(&address), length) == 0 || errno != ECONNREFUSED)
+			throw std::system_error(EADDRINUSE, std::generic_category(), "bind " + path);
+		unlink(path.c_str());
+		if (bind(socket.get(), reinterpret_cast<const sockaddr*>(&address), length) == -1)
+			throw std::system_error(errno, std::generic_category(), "bind " + path);
+	}
+	if (listen(socket.get(), backlog) == -1)
+		throw std::system_error(errno, std::generic_category(), "listen " + path);
+	return socket;
+}
+
+/**
+ * Creates a pair of connected Unix-domain stream sockets, which are closed
+ * when the process executes another program.
+ * @throws std::system_error on failure.
+ */
+inline void socket_pair(socket_handle& first, socket_handle& second) {
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1)
+		throw std::system_error(errno, std::generic_category(), "socketpair");
+	first = socket_handle(fds[0]);
+	second = socket_handle(fds[1]);
+}
+
+/**
+ * Makes sends and receives on the socket @p fd fail with EAGAIN once they
+ * have blocked for @p milliseconds, so that a stalled peer cannot block the
+ * caller forever.
+ * @throws std::system_error on failure.
+ */
+inline void set_socket_timeout(int fd, unsigned milliseconds) {
+	timeval timeout;
+	timeout.tv_sec = milliseconds / 1000;
+	timeout.tv_usec = milliseconds % 1000 * 1000;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1
+		|| setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1)
+		throw std::system_error(errno, std::generic_category(), "setsockopt");
+}
+
+/**
+ * Writes all @p size bytes at @p data to the Unix-domain socket @p fd, and
+ * passes a duplicate of the file descriptor @p passed_fd along with them.
+ * @p size must not be 0.
+ * @throws std::system_error if the socket fails.
+ */
+inline void send_with_fd(int fd, const void* data, std::size_t size, int passed_fd) {
+	iovec buffer = {const_cast<void*>(data), size};
+	union {
+		cmsghdr header;
+		char data[CMSG_SPACE(sizeof(int))];
+	} control;
+	std::memset(&control, 0, sizeof(control));
+	msghdr message = msghdr();
+	message.msg_iov = &buffer;
+	message.msg_iovlen = 1;
+	message.msg_control = control.data;
+	message.msg_controllen = sizeof(control.data);
+	cmsghdr* header = CMSG_FIRSTHDR(&message);
+	header->cmsg_level = SOL_SOCKET;
+	header->cmsg_type = SCM_RIGHTS;
+	header->cmsg_len = CMSG_LEN(sizeof(int));
+	std::memcpy(CMSG_DATA(header), &passed_fd, sizeof(int));
+
+	ssize_t n;
+	while ((n = sendmsg(fd, &message, MSG_NOSIGNAL)) == -1) {
+		if (errno != EINTR)
+			throw std::system_error(errno, std::generic_category(), "sendmsg");
+	}
+	send_all(fd, static_cast<const char*>(data) + n, size - n);
+}
+
+/**
+ * Reads at most @p size bytes from the Unix-domain socket @p fd into
+ * @p data, like recv(). If a file descriptor was passed along with them, it
+ * is stored in @p passed_fd, which the caller must close.
+ * @throws std::system_error if the socket fails.
+ */
+inline std::size_t receive_with_fd(int fd, void* data, std::size_t size, int& passed_fd) {
+	iovec buffer = {data, size};
+	union {
+		cmsghdr header;
+		char data[CMSG_SPACE(sizeof(int))];
+	} control;
+	msghdr message = msghdr();
+	message.msg_iov = &buffer;
+	message.msg_iovlen = 1;
+	message.msg_control = control.data;
+	message.msg_controllen = sizeof(control.data);
+
+	ssize_t n;
+	while ((n = recvmsg(fd, &message, 0)) == -1) {
+		if (errno != EINTR)
+			throw std::system_error(errno, std::generic_category(), "recvmsg");
+	}
+	for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+		if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+			std::memcpy(&passed_fd, CMSG_DATA(header), sizeof(int));
+	}
+	return n;
+}
+
+#endif // SOCKET_HPP
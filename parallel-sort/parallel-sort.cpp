@@ -21,6 +21,9 @@
 #include <string>
 #include <vector>
 
+#include "affinity.hpp"
+#include "thread_pool.hpp"
+
 #if !defined(NDEBUG) && defined(VERBOSE)
 #include <thread>
 #endif
@@ -37,7 +40,7 @@ public:
 	node(std::unique_ptr<node>&& left, std::unique_ptr<node>&& right) noexcept : left(std::move(left)), right(std::move(right)) {}
 
 	template<class RandomAccessIterator>
-	void parallel_merge_sort(RandomAccessIterator first, RandomAccessIterator last) {
+	void parallel_merge_sort(thread_pool& pool, RandomAccessIterator first, RandomAccessIterator last) {
 		// If this is a leaf node, sort range using sequential algorithm.
 		if (!left && !right) {
 #if !defined(NDEBUG) && defined(VERBOSE)
@@ -49,36 +52,28 @@ public:
 			return std::sort(first, last);
 		}
 
-		// Sort subrange(s) concurrently.
+		// If this node has only one child, let the child sort the whole range
+		// on the current thread.
+		if (!right)
+			return left->parallel_merge_sort(pool, first, last);
+		if (!left)
+			return right->parallel_merge_sort(pool, first, last);
+
+		// Sort subranges concurrently: the left subrange on another worker
+		// thread, and the right subrange on the current one.
 		RandomAccessIterator middle = first + ((last - first) / 2);
-		std::future<void> left_future, right_future;
-		auto sort_fn = std::bind(&node::parallel_merge_sort<RandomAccessIterator>,
-		                         std::placeholders::_1,
-		                         std::placeholders::_2,
-		                         std::placeholders::_3);
-
-		if (left && !right) {
-			left_future = std::async(std::launch::async, sort_fn, left.get(), first, last);
-		}
-		else if (!left && right) {
-			right_future = std::async(std::launch::async, sort_fn, right.get(), first, last);
-		}
-		else {
-			left_future = std::async(std::launch::async, sort_fn, left.get(), first, middle);
-			right_future = std::async(std::launch::async, sort_fn, right.get(), middle, last);
-		}
-		if (left)
-			left_future.wait();
-		if (right)
-			right_future.wait();
+		std::future<void> left_future = pool.submit(&node::parallel_merge_sort<RandomAccessIterator>,
+		                                            left.get(), std::ref(pool), first, middle);
+		right->parallel_merge_sort(pool, middle, last);
+		pool.wait(left_future);
+		left_future.get();
 
 		// Merge sorted subranges.
-		if (left && right)
-			std::inplace_merge(first, middle, last);
+		std::inplace_merge(first, middle, last);
 	}
 
 	template<class RandomAccessIterator, class Compare>
-	void parallel_merge_sort(RandomAccessIterator first, RandomAccessIterator last, Compare comp) {
+	void parallel_merge_sort(thread_pool& pool, RandomAccessIterator first, RandomAccessIterator last, Compare comp) {
 		// If this is a leaf node, sort range using sequential algorithm.
 		if (!left && !right) {
 #if !defined(NDEBUG) && defined(VERBOSE)
@@ -90,33 +85,24 @@ public:
 			return std::sort(first, last, comp);
 		}
 
-		// Sort subrange(s) concurrently.
+		// If this node has only one child, let the child sort the whole range
+		// on the current thread.
+		if (!right)
+			return left->parallel_merge_sort(pool, first, last, comp);
+		if (!left)
+			return right->parallel_merge_sort(pool, first, last, comp);
+
+		// Sort subranges concurrently: the left subrange on another worker
+		// thread, and the right subrange on the current one.
 		RandomAccessIterator middle = first + ((last - first) / 2);
-		std::future<void> left_future, right_future;
-		auto sort_fn = std::bind(&node::parallel_merge_sort<RandomAccessIterator, Compare>,
-		                         std::placeholders::_1,
-		                         std::placeholders::_2,
-		                         std::placeholders::_3,
-		                         std::placeholders::_4);
-
-		if (left && !right) {
-			left_future = std::async(std::launch::async, sort_fn, left.get(), first, last, comp);
-		}
-		else if (!left && right) {
-			right_future = std::async(std::launch::async, sort_fn, right.get(), first, last, comp);
-		}
-		else {
-			left_future = std::async(std::launch::async, sort_fn, left.get(), first, middle, comp);
-			right_future = std::async(std::launch::async, sort_fn, right.get(), middle, last, comp);
-		}
-		if (left)
-			left_future.wait();
-		if (right)
-			right_future.wait();
+		std::future<void> left_future = pool.submit(&node::parallel_merge_sort<RandomAccessIterator, Compare>,
+		                                            left.get(), std::ref(pool), first, middle, comp);
+		right->parallel_merge_sort(pool, middle, last, comp);
+		pool.wait(left_future);
+		left_future.get();
 
 		// Merge sorted subranges.
-		if (left && right)
-			std::inplace_merge(first, middle, last, comp);
+		std::inplace_merge(first, middle, last, comp);
 	}
 };
 
@@ -129,12 +115,33 @@ void get_lines(std::basic_istream<CharT, Traits>& in, std::vector<std::basic_str
 std::unique_ptr<node> make_tree(std::size_t n_leaves);
 
 template<class RandomAccessIterator>
-void parallel_merge_sort(RandomAccessIterator first, RandomAccessIterator last, std::size_t n_threads);
+void parallel_merge_sort(RandomAccessIterator first, RandomAccessIterator last, std::size_t n_threads, affinity_policy affinity = affinity_policy::none);
 
 template<class RandomAccessIterator, class Compare>
-void parallel_merge_sort(RandomAccessIterator first, RandomAccessIterator last, Compare comp, std::size_t n_threads);
+void parallel_merge_sort(RandomAccessIterator first, RandomAccessIterator last, Compare comp, std::size_t n_threads, affinity_policy affinity = affinity_policy::none);
 
 int main(int argc, char* argv[]) {
+	affinity_policy affinity = affinity_policy::none;
+
+	// Parse command-line options, and remove them from argv so that only the
+	// positional arguments remain.
+	int arg_count = 1;
+	for (int i = 1; i < argc; i++) {
+		if (is_affinity_option(argv[i])) {
+			if (!parse_affinity_option(PACKAGE_NAME, argv[i], affinity))
+				return 1;
+		}
+		else if (std::strncmp(argv[i], "--", 2) == 0) {
+			std::cerr << PACKAGE_NAME << ": Unrecognized option '" << argv[i]
+			          << "'." << std::endl;
+			return 1;
+		}
+		else {
+			argv[arg_count++] = argv[i];
+		}
+	}
+	argc = arg_count;
+
 	if (argc != 3) {
 		show_usage(std::cerr);
 		return 1;
@@ -185,7 +192,7 @@ int main(int argc, char* argv[]) {
 	}
 
 	// Perform the parallel merge sort operation.
-	parallel_merge_sort(lines.begin(), lines.end(), thread_count);
+	parallel_merge_sort(lines.begin(), lines.end(), thread_count, affinity);
 
 	// Write the sorted lines to standard output.
 	for (const std::string& line : lines)
@@ -196,13 +203,16 @@ int main(int argc, char* argv[]) {
 
 template<class CharT, class Traits>
 void show_usage(std::basic_ostream<CharT, Traits>& out) {
-	out << "Usage: " << PACKAGE_NAME << " <input file> <number of threads>\n"
+	out << "Usage: " << PACKAGE_NAME << " [options] <input file> <number of threads>\n"
 	    << "Sort the lines in <input file> using a merge sort algorithm that executes\n"
 	    << "<number of threads> tasks in parallel, and write the result to standard\n"
 	    << "output.\n\n"
 	    << "If <input file> is -, the program reads from standard input.\n\n"
-	    << "If the specified number of threads is 0, the program uses " << CPU_COUNT << " by default."
-	    << std::endl;
+	    << "If the specified number of threads is 0, the program uses " << PROCESSOR_COUNT << " by default\n"
+	    << "(or the number of physical cores with --affinity=physical-cores).\n\n"
+	    << "Options:\n"
+	    << AFFINITY_OPTION_USAGE
+	    << std::flush;
 }
 
 template<class CharT, class Traits, class Allocator>
@@ -249,17 +259,19 @@ std::unique_ptr<node> make_tree(std::size_t n_leaves) {
 }
 
 template<class RandomAccessIterator>
-void parallel_merge_sort(RandomAccessIterator first, RandomAccessIterator last, std::size_t n_threads) {
+void parallel_merge_sort(RandomAccessIterator first, RandomAccessIterator last, std::size_t n_threads, affinity_policy affinity) {
 	if (n_threads == 0)
-		n_threads = std::min(SIZE_C(CPU_COUNT), static_cast<std::size_t>(last - first));
+		n_threads = std::min(default_thread_count(affinity, SIZE_C(PROCESSOR_COUNT)), static_cast<std::size_t>(last - first));
+	thread_pool pool(n_threads, make_affinity_initializer(affinity));
 	std::unique_ptr<node> head = make_tree(n_threads);
-	head->parallel_merge_sort(first, last);
+	pool.submit(&node::parallel_merge_sort<RandomAccessIterator>, head.get(), std::ref(pool), first, last).get();
 }
 
 template<class RandomAccessIterator, class Compare>
-void parallel_merge_sort(RandomAccessIterator first, RandomAccessIterator last, Compare comp, std::size_t n_threads) {
+void parallel_merge_sort(RandomAccessIterator first, RandomAccessIterator last, Compare comp, std::size_t n_threads, affinity_policy affinity) {
 	if (n_threads == 0)
-		n_threads = std::min(SIZE_C(CPU_COUNT), static_cast<std::size_t>(last - first));
+		n_threads = std::min(default_thread_count(affinity, SIZE_C(PROCESSOR_COUNT)), static_cast<std::size_t>(last - first));
+	thread_pool pool(n_threads, make_affinity_initializer(affinity));
 	std::unique_ptr<node> head = make_tree(n_threads);
-	head->parallel_merge_sort(first, last, comp);
+	pool.submit(&node::parallel_merge_sort<RandomAccessIterator, Compare>, head.get(), std::ref(pool), first, last, comp).get();
 }
@@ -11,16 +11,121 @@
 #include "config.hpp"
 
 #include <cinttypes>
+#include <climits>
 #include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <fstream>
 #include <future>
 #include <iostream>
+#include <iterator>
+#include <new>
 #include <random>
+#include <string>
 #include <vector>
 
+#include <sys/resource.h>
+
+#include "affinity.hpp"
+#include "thread_pool.hpp"
+
 #define PRIMALITY_TEST_COUNT 100
 
+// The integers that are tested for small prime factors before any Fermat
+// tests: the circumference of the 2-3-5 wheel, and the bound of the primes
+// used by passes_prefilter().
+#define WHEEL_SIZE 30
+#define SMALL_PRIME_LIMIT 102
+
+// wheel[n % WHEEL_SIZE] is true if n is coprime to 2, 3 and 5.
+static const bool wheel[WHEEL_SIZE] = {
+	false, true,  false, false, false, false, false, true,  false, false,
+	false, true,  false, true,  false, false, false, true,  false, true,
+	false, false, false, true,  false, false, false, false, false, true
+};
+
+// The primes less than SMALL_PRIME_LIMIT.
+static const std::uintmax_t small_primes[] = {
+	2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 67, 71,
+	73, 79, 83, 89, 97, 101
+};
+
+// The number of chunks that each thread's share of the integers to be tested
+// is divided into, and the minimum number of integers in a chunk.
+#define CHUNKS_PER_THREAD 8
+#define MIN_GRAIN_SIZE 64
+
+// With --memory-limit, the number of chunks per thread that may be in flight
+// (being tested or waiting to be written) at once, and the estimated memory
+// used by each chunk in addition to its prime table.
+#define IN_FLIGHT_CHUNKS_PER_THREAD 2
+#define CHUNK_OVERHEAD 256
+
+// The assumed size of a cache line, used to keep per-thread counters that are
+// updated concurrently on separate lines.
+#define CACHE_LINE_SIZE 64
+
+typedef std::chrono::steady_clock stats_clock;
+
+// Counters collected by each worker thread for --stats.
+struct alignas(CACHE_LINE_SIZE) thread_stats {
+	std::uintmax_t numbers_tested;
+	std::uintmax_t primes_found;
+	stats_clock::duration busy_time;
+};
+
+// Allocates storage aligned to a cache line, which std::allocator does not
+// guarantee for over-aligned types before C++17.
+template<class T>
+struct cache_aligned_allocator {
+	typedef T value_type;
+
+	cache_aligned_allocator() noexcept {}
+
+	template<class U>
+	cache_aligned_allocator(const cache_aligned_allocator<U>&) noexcept {}
+
+	T* allocate(std::size_t n) {
+		void* p;
+		if (posix_memalign(&p, CACHE_LINE_SIZE, n * sizeof(T)) != 0)
+			throw std::bad_alloc();
+		return static_cast<T*>(p);
+	}
+
+	void deallocate(T* p, std::size_t) noexcept {
+		std::free(p);
+	}
+};
+
+template<class T, class U>
+bool operator==(const cache_aligned_allocator<T>&, const cache_aligned_allocator<U>&) noexcept {
+	return true;
+}
+
+template<class T, class U>
+bool operator!=(const cache_aligned_allocator<T>&, const cache_aligned_allocator<U>&) noexcept {
+	return false;
+}
+
+// Statistics about a whole run, reported by --stats.
+struct run_stats {
+	std::intmax_t prime_count;
+	std::intmax_t thread_count;
+	std::uintmax_t max_prime;
+	std::uintmax_t grain_size;
+	std::size_t chunk_count;
+	std::uintmax_t memory_limit;
+	std::size_t in_flight_limit;
+	stats_clock::duration bounds_time;
+	stats_clock::duration compute_time;
+	stats_clock::duration output_time;
+	std::vector<thread_stats, cache_aligned_allocator<thread_stats>> threads;
+};
+
 template<class CharT, class Traits>
 void show_usage(std::basic_ostream<CharT, Traits>& out);
 
@@ -29,11 +134,67 @@ IntType random_int(IntType min, IntType max);
 
 std::uintmax_t mod_pow(std::uintmax_t x, std::uintmax_t y, std::uintmax_t n);
 
+std::uintmax_t gcd(std::uintmax_t a, std::uintmax_t b);
+
+bool passes_prefilter(std::uintmax_t n);
+
 bool is_prime(std::uintmax_t n);
 
 std::vector<bool> test_primes_in_range(std::uintmax_t offset, std::size_t size);
 
+std::uintmax_t chunk_memory_usage(std::uintmax_t size);
+
+bool parse_memory_size(const char* str, std::uintmax_t& size);
+
+template<class CharT, class Traits>
+void write_stats_json(std::basic_ostream<CharT, Traits>& out, const run_stats& stats);
+
+long peak_rss_bytes();
+
 int main(int argc, char* argv[]) {
+	affinity_policy affinity = affinity_policy::none;
+	bool stats_enabled = false;
+	const char* stats_path = nullptr;
+	std::uintmax_t memory_limit = 0;
+
+	// Parse command-line options, and remove them from argv so that only the
+	// positional arguments remain.
+	int arg_count = 1;
+	for (int i = 1; i < argc; i++) {
+		if (is_affinity_option(argv[i])) {
+			if (!parse_affinity_option(PACKAGE_NAME, argv[i], affinity))
+				return 1;
+		}
+		else if (std::strncmp(argv[i], "--memory-limit=", 15) == 0) {
+			if (!parse_memory_size(argv[i] + 15, memory_limit) || memory_limit == 0) {
+				std::cerr << PACKAGE_NAME << ": Invalid memory limit '"
+				          << (argv[i] + 15) << "'." << std::endl;
+				return 1;
+			}
+		}
+		else if (std::strncmp(argv[i], "--stats=", 8) == 0) {
+			if (std::strcmp(argv[i] + 8, "json") != 0) {
+				std::cerr << PACKAGE_NAME << ": Invalid statistics format '"
+				          << (argv[i] + 8) << "'." << std::endl;
+				return 1;
+			}
+			stats_enabled = true;
+		}
+		else if (std::strncmp(argv[i], "--stats-file=", 13) == 0) {
+			stats_enabled = true;
+			stats_path = argv[i] + 13;
+		}
+		else if (std::strncmp(argv[i], "--", 2) == 0) {
+			std::cerr << PACKAGE_NAME << ": Unrecognized option '" << argv[i]
+			          << "'." << std::endl;
+			return 1;
+		}
+		else {
+			argv[arg_count++] = argv[i];
+		}
+	}
+	argc = arg_count;
+
 	if (argc != 3) {
 		show_usage(std::cerr);
 		return 1;
@@ -69,7 +230,7 @@ int main(int argc, char* argv[]) {
 		return 0;
 
 	if (thread_count == 0)
-		thread_count = std::min(INTMAX_C(CPU_COUNT), prime_count);
+		thread_count = std::min(static_cast<std::intmax_t>(default_thread_count(affinity, PROCESSOR_COUNT)), prime_count);
 
 	if (thread_count > prime_count) {
 		std::cerr << PACKAGE_NAME
@@ -78,48 +239,135 @@ int main(int argc, char* argv[]) {
 		return 1;
 	}
 
+	run_stats stats = run_stats();
+	stats.prime_count = prime_count;
+	stats.thread_count = thread_count;
+	stats.threads.resize(thread_count);
+
+	stats_clock::time_point phase_start = stats_clock::now();
+
 	// Use Rosser's theorem to calculate the upper bound of the nth prime
 	// number, where n is prime_count.
 	const std::uintmax_t max_prime = prime_count < 6 ? 12 : prime_count * (std::log(prime_count) + std::log(std::log(prime_count)));
 
-	// Divide the set of integers in [0, max_prime) into chunks/ranges, one
-	// for each thread.
-	const auto range_div = std::div(max_prime, thread_count);
+	// Divide the set of integers in [0, max_prime) into chunks/ranges. There
+	// are several chunks per thread so that threads which finish their share
+	// early can steal the remaining chunks of slower ones.
+	std::uintmax_t grain_size = std::max<std::uintmax_t>(MIN_GRAIN_SIZE, (max_prime + thread_count * CHUNKS_PER_THREAD - 1) / (thread_count * CHUNKS_PER_THREAD));
+	std::size_t in_flight_limit = thread_count * CHUNKS_PER_THREAD;
 
-	std::vector<std::uintmax_t> range_offsets(thread_count);
-	std::vector<std::future<std::vector<bool>>> prime_table_futures(thread_count);
+	// If there is a memory limit, shrink the chunks so that enough of them
+	// to keep every thread busy fit within the limit. Only in_flight_limit
+	// chunks are being tested or waiting to be written at any time.
+	if (memory_limit != 0) {
+		in_flight_limit = thread_count * IN_FLIGHT_CHUNKS_PER_THREAD;
+		const std::uintmax_t chunk_memory_limit = memory_limit / in_flight_limit;
+		if (chunk_memory_limit < chunk_memory_usage(MIN_GRAIN_SIZE)) {
+			std::cerr << PACKAGE_NAME << ": The memory limit must be at least "
+			          << in_flight_limit * chunk_memory_usage(MIN_GRAIN_SIZE)
+			          << " bytes for " << thread_count << " threads." << std::endl;
+			return 1;
+		}
+		grain_size = std::min(grain_size, (chunk_memory_limit - CHUNK_OVERHEAD) * CHAR_BIT);
+	}
 
-	// Perform primality tests on each range of integers.
-	for (std::size_t i = 0; i < thread_count; i++) {
-		const std::size_t range_size = range_div.quot + (i == 0 ? range_div.rem : 0);
-		const std::uintmax_t range_offset = i * range_size + (i > 0 ? range_div.rem : 0);
-		range_offsets[i] = range_offset;
-		prime_table_futures[i] = std::async(std::launch::async, test_primes_in_range, range_offset, range_size);
+	const std::size_t chunk_count = (max_prime + grain_size - 1) / grain_size;
+
+	stats.max_prime = max_prime;
+	stats.grain_size = grain_size;
+	stats.chunk_count = chunk_count;
+	stats.memory_limit = memory_limit;
+	stats.in_flight_limit = in_flight_limit;
+	stats.bounds_time = stats_clock::now() - phase_start;
+	phase_start = stats_clock::now();
+
+	// Perform primality tests on each range of integers, and write the list
+	// of prime numbers to standard output as soon as each range and all the
+	// ranges before it are done.
+	{
+		thread_pool pool(thread_count, make_affinity_initializer(affinity));
+		std::atomic<bool> cancelled(false);
+
+		auto test_chunk = [&](std::uintmax_t offset, std::size_t size) -> std::vector<bool> {
+			if (cancelled.load(std::memory_order_relaxed))
+				return std::vector<bool>();
+
+			const stats_clock::time_point start = stats_clock::now();
+			std::vector<bool> prime_table = test_primes_in_range(offset, size);
+
+			thread_stats& worker_stats = stats.threads[pool.worker_index()];
+			worker_stats.numbers_tested += size;
+			worker_stats.primes_found += std::count(prime_table.begin(), prime_table.end(), true);
+			worker_stats.busy_time += stats_clock::now() - start;
+			return prime_table;
+		};
+
+		std::deque<std::pair<std::uintmax_t, std::future<std::vector<bool>>>> in_flight;
+		std::uintmax_t next_offset = 0;
+
+		while (prime_count > 0 && (next_offset < max_prime || !in_flight.empty())) {
+			while (in_flight.size() < in_flight_limit && next_offset < max_prime) {
+				const std::size_t size = std::min(grain_size, max_prime - next_offset);
+				in_flight.emplace_back(next_offset, pool.submit(test_chunk, next_offset, size));
+				next_offset += size;
+			}
+
+			const std::uintmax_t offset = in_flight.front().first;
+			const std::vector<bool> prime_table = in_flight.front().second.get();
+			in_flight.pop_front();
+
+			const stats_clock::time_point output_start = stats_clock::now();
+			for (std::size_t j = 0; j < prime_table.size() && prime_count > 0; j++) {
+				if (prime_table[j]) {
+					std::cout << (offset + j) << std::endl;
+					prime_count--;
+				}
+			}
+			stats.output_time += stats_clock::now() - output_start;
+		}
+
+		// Skip the chunks that are no longer needed.
+		cancelled = true;
 	}
 
-	// Write the list of prime numbers to standard output.
-	for (std::size_t i = 0; i < thread_count; i++) {
-		const std::vector<bool> prime_table = prime_table_futures[i].get();
-		for (std::size_t j = 0; j < prime_table.size(); j++) {
-			if (prime_table[j]) {
-				std::cout << (range_offsets[i] + j) << std::endl;
-				if (--prime_count == 0)
-					goto exit;
+	std::cout.flush();
+	stats.compute_time = stats_clock::now() - phase_start;
+
+	// Write the statistics report.
+	if (stats_enabled) {
+		if (stats_path) {
+			std::ofstream stats_out(stats_path);
+			write_stats_json(stats_out, stats);
+			if (!stats_out) {
+				std::cerr << PACKAGE_NAME << ": Could not write " << stats_path
+				          << "." << std::endl;
+				return 1;
 			}
 		}
+		else {
+			write_stats_json(std::cerr, stats);
+		}
 	}
 
-exit:
 	return 0;
 }
 
 template<class CharT, class Traits>
 void show_usage(std::basic_ostream<CharT, Traits>& out) {
-	out << "Usage: " << PACKAGE_NAME << " <number of primes> <number of threads>\n"
+	out << "Usage: " << PACKAGE_NAME << " [options] <number of primes> <number of threads>\n"
 	    << "Write the first <number of primes> prime numbers to standard output using an\n"
 	    << "algorithm that executes <number of threads> tasks in parallel.\n\n"
-	    << "If the specified number of threads is 0, the program uses " << CPU_COUNT << " by default.\n"
-	    << "Prime numbers are separated by newlines."
+	    << "If the specified number of threads is 0, the program uses " << PROCESSOR_COUNT << " by default\n"
+	    << "(or the number of physical cores with --affinity=physical-cores).\n"
+	    << "Prime numbers are separated by newlines.\n\n"
+	    << "Options:\n"
+	    << AFFINITY_OPTION_USAGE
+	    << "  --memory-limit=<size>\n"
+	    << "                       Limit the memory used for prime tables to <size> bytes.\n"
+	    << "                       <size> may end with K, M or G.\n"
+	    << "  --stats=json         Write a JSON report of per-thread counters, phase\n"
+	    << "                       timings and peak memory usage to standard error.\n"
+	    << "  --stats-file=<file>  Write the --stats=json report to <file> instead."
 	    << std::endl;
 }
 
@@ -131,21 +379,70 @@ IntType random_int(IntType min, IntType max) {
 	return uniform_dist(generator);
 }
 
-// Precondition: n != 0.
+// Returns a * b % n without overflowing, however large n is.
+// Precondition: a < n and b < n.
+std::uintmax_t mul_mod(std::uintmax_t a, std::uintmax_t b, std::uintmax_t n) {
+#if HAVE_UNSIGNED_INT128
+	return static_cast<std::uintmax_t>(static_cast<unsigned __int128>(a) * b % n);
+#else
+	// Add a doubling a for each bit of b, reducing after every step.
+	std::uintmax_t result = 0;
+	while (b != 0) {
+		if (b & 1)
+			result = result >= n - a ? result - (n - a) : result + a;
+		a = a >= n - a ? a - (n - a) : a + a;
+		b >>= 1;
+	}
+	return result;
+#endif
+}
+
+// Precondition: n != 0 and x < n.
 std::uintmax_t mod_pow(std::uintmax_t x, std::uintmax_t y, std::uintmax_t n) {
 	if (y == 0)
-		return 1;
-	std::uintmax_t z = mod_pow(x, y / 2, n);
+		return 1 % n;
+	const std::uintmax_t z = mod_pow(x, y / 2, n);
+	const std::uintmax_t z_squared = mul_mod(z, z, n);
 	if (y % 2 == 0)
-		return z * z % n;
-	return x * z * z % n;
+		return z_squared;
+	return mul_mod(x, z_squared, n);
+}
+
+std::uintmax_t gcd(std::uintmax_t a, std::uintmax_t b) {
+	while (b != 0) {
+		const std::uintmax_t r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+// Returns true if @p n may be prime, or false if it has a prime factor less
+// than SMALL_PRIME_LIMIT. Multiples of 2, 3 and 5 are assumed to have been
+// skipped by the wheel already.
+// Precondition: n >= SMALL_PRIME_LIMIT.
+bool passes_prefilter(std::uintmax_t n) {
+#if HAVE_UNSIGNED_INT128
+	// The product of the primes from 7 to 101, which fits in 128 bits.
+	static constexpr unsigned __int128 small_prime_product = (static_cast<unsigned __int128>(UINT64_C(0x05d6ec0849b19b04)) << 64) | UINT64_C(0xec36b9eeafbfe991);
+	return gcd(n, static_cast<std::uintmax_t>(small_prime_product % n)) == 1;
+#else
+	// The product of the primes from 7 to 47, which fits in 64 bits.
+	static constexpr std::uint64_t small_prime_product = UINT64_C(0x0048d14ccb92cf27);
+	return gcd(n, small_prime_product % n) == 1;
+#endif
 }
 
 // NOTE: Implemented using Fermat's little theorem. The probability of the
 // primality test returning a false positive is 1 / 2^k, where
 // k = PRIMALITY_TEST_COUNT.
+// Before any Fermat tests are done, n is checked for small prime factors:
+// multiples of 2, 3 and 5 are rejected by the wheel, and multiples of the
+// other primes less than SMALL_PRIME_LIMIT by passes_prefilter().
 bool is_prime(std::uintmax_t n) {
-	if (n < 2)
+	if (n < SMALL_PRIME_LIMIT)
+		return std::binary_search(std::begin(small_primes), std::end(small_primes), n);
+	if (!wheel[n % WHEEL_SIZE] || !passes_prefilter(n))
 		return false;
 	for (std::size_t i = 0; i < PRIMALITY_TEST_COUNT; i++) {
 		const std::uintmax_t a = random_int<std::uintmax_t>(1, n - 1);
@@ -158,8 +455,108 @@ bool is_prime(std::uintmax_t n) {
 std::vector<bool> test_primes_in_range(std::uintmax_t offset, std::size_t size) {
 	std::vector<bool> prime_table(size, false);
 
-	for (std::size_t i = 0; i < size; i++)
-		prime_table[i] = is_prime(offset + i);
+	// Skip integers that are not coprime to WHEEL_SIZE without calling
+	// is_prime(), except for 2, 3 and 5 themselves.
+	std::size_t residue = offset % WHEEL_SIZE;
+	for (std::size_t i = 0; i < size; i++) {
+		if (wheel[residue] || offset + i < WHEEL_SIZE)
+			prime_table[i] = is_prime(offset + i);
+		if (++residue == WHEEL_SIZE)
+			residue = 0;
+	}
 
 	return prime_table;
 }
+
+// Returns an estimate of the memory used by a chunk of @p size integers while
+// it is in flight.
+std::uintmax_t chunk_memory_usage(std::uintmax_t size) {
+	return (size + CHAR_BIT - 1) / CHAR_BIT + CHUNK_OVERHEAD;
+}
+
+// Parses a memory size in bytes, optionally followed by a K, M or G suffix
+// (powers of 1024). Returns false if @p str is not a valid size.
+bool parse_memory_size(const char* str, std::uintmax_t& size) {
+	char* end;
+	if (*str == '-')
+		return false;
+	size = std::strtoumax(str, &end, 10);
+	if (end == str)
+		return false;
+
+	unsigned shift = 0;
+	switch (*end) {
+	case '\0': break;
+	case 'K': case 'k': shift = 10; end++; break;
+	case 'M': case 'm': shift = 20; end++; break;
+	case 'G': case 'g': shift = 30; end++; break;
+	default: return false;
+	}
+	if (*end != '\0' || size > (UINTMAX_MAX >> shift))
+		return false;
+	size <<= shift;
+	return true;
+}
+
+// Writes @p stats as a JSON object followed by a newline. Durations are in
+// seconds. The compute phase includes writing output, which overlaps with
+// testing; output_seconds is the part of it spent writing. A thread's wait
+// time is the part of the compute phase that it did not spend testing
+// numbers.
+template<class CharT, class Traits>
+void write_stats_json(std::basic_ostream<CharT, Traits>& out, const run_stats& stats) {
+	typedef std::chrono::duration<double> seconds;
+
+	const double compute_seconds = std::chrono::duration_cast<seconds>(stats.compute_time).count();
+	const double total_seconds = std::chrono::duration_cast<seconds>(stats.bounds_time + stats.compute_time).count();
+
+	std::uintmax_t numbers_tested = 0;
+	for (const thread_stats& thread : stats.threads)
+		numbers_tested += thread.numbers_tested;
+
+	out << "{\"program\":\"" << PACKAGE_NAME << "\""
+	    << ",\"version\":\"" << PACKAGE_VERSION << "\""
+	    << ",\"prime_count\":" << stats.prime_count
+	    << ",\"thread_count\":" << stats.thread_count
+	    << ",\"max_prime\":" << stats.max_prime
+	    << ",\"grain_size\":" << stats.grain_size
+	    << ",\"chunk_count\":" << stats.chunk_count
+	    << ",\"memory_limit\":" << stats.memory_limit
+	    << ",\"in_flight_limit\":" << stats.in_flight_limit
+	    << ",\"phases\":{"
+	    << "\"bounds_seconds\":" << std::chrono::duration_cast<seconds>(stats.bounds_time).count()
+	    << ",\"compute_seconds\":" << compute_seconds
+	    << ",\"output_seconds\":" << std::chrono::duration_cast<seconds>(stats.output_time).count()
+	    << ",\"total_seconds\":" << total_seconds
+	    << "}"
+	    << ",\"candidates_per_second\":" << (compute_seconds > 0 ? numbers_tested / compute_seconds : 0)
+	    << ",\"peak_rss_bytes\":" << peak_rss_bytes()
+	    << ",\"threads\":[";
+	for (std::size_t i = 0; i < stats.threads.size(); i++) {
+		const thread_stats& thread = stats.threads[i];
+		const double busy_seconds = std::chrono::duration_cast<seconds>(thread.busy_time).count();
+		out << (i > 0 ? "," : "")
+		    << "{\"id\":" << i
+		    << ",\"numbers_tested\":" << thread.numbers_tested
+		    << ",\"primes_found\":" << thread.primes_found
+		    << ",\"busy_seconds\":" << busy_seconds
+		    << ",\"wait_seconds\":" << std::max(compute_seconds - busy_seconds, 0.0)
+		    << "}";
+	}
+	out << "]}" << std::endl;
+}
+
+// Returns the peak resident set size of this process in bytes, or -1 if it is
+// not available.
+long peak_rss_bytes() {
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return -1;
+	// NOTE: ru_maxrss is in kilobytes on Linux and Cygwin, but in bytes on
+	// OS X.
+#if defined(__APPLE__)
+	return usage.ru_maxrss;
+#else
+	return usage.ru_maxrss * 1024L;
+#endif
+}